@@ -0,0 +1,426 @@
+#include <Defines.h>
+
+#include <BasicDocumentModel.h>
+#include <DocumentViewPrivate.h>
+#include <ImagingService.h>
+#include <PixelConversion.h>
+#include <SelectionModel.h>
+
+#include <wincodec.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cwchar>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace DocumentViewPrivate;
+
+/// @brief Distribution of synthetic page sizes
+enum class TSizeDistribution {
+    Fixed, // Every page is A4 portrait
+    Uniform, // Width and height are uniform in [200, 2000]
+    Mixed // Mostly portrait pages with some landscape ones, slightly jittered
+};
+
+static const char* NameOf(TSizeDistribution distribution)
+{
+    switch (distribution)
+    {
+    case TSizeDistribution::Fixed:
+        return "fixed";
+    case TSizeDistribution::Uniform:
+        return "uniform";
+    case TSizeDistribution::Mixed:
+        return "mixed";
+    }
+    return "";
+}
+
+static const char* NameOf(TImagesViewAlignment alignment)
+{
+    switch (alignment)
+    {
+    case TImagesViewAlignment::AlignLeft:
+        return "AlignLeft";
+    case TImagesViewAlignment::AlignRight:
+        return "AlignRight";
+    case TImagesViewAlignment::AlignHCenter:
+        return "AlignHCenter";
+    case TImagesViewAlignment::HorizontalFlow:
+        return "HorizontalFlow";
+    }
+    return "";
+}
+
+/// @brief Page with a known size and no bitmap, nothing is decoded
+class CSyntheticPage : public IPage
+{
+public:
+    CSyntheticPage(const IDocument* parent, SIZE size) : parent{parent}, size{size} {}
+
+    const IDocument* GetDocument() const override { return parent; }
+    TPageState GetPageState() const override { return TPageState::READY; }
+    SIZE GetPageSize() const override { return size; }
+    void PrepareBitmapForTarget(ID2D1RenderTarget*, float) override {}
+    ID2D1Bitmap* GetPageBitmap() const override { return nullptr; }
+    void ReleaseBitmap() override {}
+
+private:
+    const IDocument* parent;
+    SIZE size;
+};
+
+/// @brief Document with a given number of synthetic pages
+class CSyntheticDocument : public IDocument
+{
+public:
+    CSyntheticDocument(int pagesCount, TSizeDistribution distribution, unsigned seed)
+    {
+        std::mt19937 random{seed};
+        std::uniform_int_distribution<LONG> uniformSide{200, 2000};
+        std::uniform_real_distribution<float> jitter{0.9f, 1.1f};
+        std::bernoulli_distribution isLandscape{0.3};
+
+        pages.reserve(pagesCount);
+        for (int i = 0; i < pagesCount; ++i) {
+            SIZE size{850, 1100};
+            if (distribution == TSizeDistribution::Uniform) {
+                size = {uniformSide(random), uniformSide(random)};
+            } else if (distribution == TSizeDistribution::Mixed) {
+                if (isLandscape(random)) {
+                    std::swap(size.cx, size.cy);
+                }
+                size.cx = LONG(size.cx * jitter(random));
+                size.cy = LONG(size.cy * jitter(random));
+            }
+            pages.push_back(std::make_unique<CSyntheticPage>(this, size));
+        }
+    }
+
+    const wchar_t* GetName() const override { return L"Synthetic"; }
+    int GetPagesCount() const override { return pages.size(); }
+    const IPage* GetPage(int index) const override { return pages.at(index).get(); }
+    int GetIndexOf(const IPage* page) const override
+    {
+        for (size_t i = 0; i < pages.size(); ++i) {
+            if (pages[i].get() == page) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+private:
+    std::vector<std::unique_ptr<CSyntheticPage>> pages;
+};
+
+/// @brief Prints measurements as an array of JSON objects
+class CResultsWriter
+{
+public:
+    CResultsWriter(TSizeDistribution distribution, bool isFixedTextMetrics, unsigned seed)
+    {
+        std::cout << "{\n  \"benchmark\": \"layout\",\n  \"distribution\": \"" << NameOf(distribution)
+                  << "\",\n  \"textMeasurer\": \"" << (isFixedTextMetrics ? "fixed" : "directwrite")
+                  << "\",\n  \"seed\": " << seed << ",\n  \"results\": [";
+    }
+
+    ~CResultsWriter()
+    {
+        std::cout << "\n  ]\n}\n";
+    }
+
+    /// @brief Print one measurement
+    /// @param pages Number of pages in the layout
+    /// @param operation Name of the measured operation
+    /// @param alignment Alignment the operation ran with
+    /// @param iterations How many times the operation ran
+    /// @param elapsed Total time of all iterations
+    void Write(int pages, const char* operation, TImagesViewAlignment alignment, int iterations,
+               std::chrono::steady_clock::duration elapsed)
+    {
+        const double totalMs = std::chrono::duration<double, std::milli>(elapsed).count();
+        std::cout << (isFirst ? "\n" : ",\n")
+                  << "    {\"pages\": " << pages
+                  << ", \"operation\": \"" << operation
+                  << "\", \"alignment\": \"" << NameOf(alignment)
+                  << "\", \"iterations\": " << iterations
+                  << ", \"totalMs\": " << totalMs
+                  << ", \"perOperationUs\": " << totalMs * 1000.0 / std::max(iterations, 1)
+                  << "}";
+        std::cout.flush();
+        isFirst = false;
+    }
+
+    /// @brief Print one measurement of a pixel conversion
+    /// @param pixels Number of pixels converted by one iteration
+    /// @param operation Name of the measured conversion
+    /// @param iterations How many times the conversion ran
+    /// @param elapsed Total time of all iterations
+    void WriteConversion(size_t pixels, const char* operation, int iterations, std::chrono::steady_clock::duration elapsed)
+    {
+        const double totalMs = std::chrono::duration<double, std::milli>(elapsed).count();
+        std::cout << (isFirst ? "\n" : ",\n")
+                  << "    {\"pixels\": " << pixels
+                  << ", \"operation\": \"" << operation
+                  << "\", \"iterations\": " << iterations
+                  << ", \"totalMs\": " << totalMs
+                  << ", \"perOperationUs\": " << totalMs * 1000.0 / std::max(iterations, 1)
+                  << ", \"megapixelsPerSecond\": " << double(pixels) * iterations / std::max(totalMs * 1000.0, 1e-3)
+                  << "}";
+        std::cout.flush();
+        isFirst = false;
+    }
+
+private:
+    bool isFirst = true;
+};
+
+/// Keeps the results of measured queries alive so they are not optimized out
+static volatile size_t resultsSink = 0;
+
+template <typename TOperation>
+static std::chrono::steady_clock::duration Measure(TOperation&& operation)
+{
+    const auto start = std::chrono::steady_clock::now();
+    operation();
+    return std::chrono::steady_clock::now() - start;
+}
+
+/// @brief Run every measured operation against a model of pagesCount pages
+static void RunBenchmark(CResultsWriter& results, int pagesCount, TSizeDistribution distribution,
+                         bool isFixedTextMetrics, unsigned seed)
+{
+    constexpr auto defaultAlignment = TImagesViewAlignment::AlignLeft;
+
+    CBasicDocumentModel model;
+    auto document = new CSyntheticDocument(pagesCount, distribution, seed);
+    results.Write(pagesCount, "Model.AddDocument", defaultAlignment, 1, Measure([&] {
+        model.AddDocument(document);
+    }));
+
+    std::vector<CPageInfo> pageInfos(pagesCount);
+    results.Write(pagesCount, "Model.GetPages", defaultAlignment, 1, Measure([&] {
+        model.GetPages(0, pagesCount, pageInfos.data());
+    }));
+
+    CSelectionModel selectionModel{&model};
+    selectionModel.Select(0, TSelectionMode::SelectOne);
+    results.Write(pagesCount, "Selection.SelectRange", defaultAlignment, 1, Measure([&] {
+        selectionModel.Select(pagesCount - 1, TSelectionMode::SelectRange);
+    }));
+    selectionModel.ClearSelection();
+
+    // Layout is computed in background, every measurement waits until it is published
+    CDocumentLayoutHelper helper;
+    helper.SetRenderTargetSize(D2D1_SIZE_F{1280.f, 720.f});
+    if (isFixedTextMetrics) {
+        // Roughly the metrics of the model's 28 DIP header font
+        helper.SetTextMeasurer(std::make_shared<CFixedTextMeasurer>(14.f, 33.f));
+    }
+
+    results.Write(pagesCount, "Layout.AddPage", defaultAlignment, pagesCount, Measure([&] {
+        for (const auto& pageInfo : pageInfos) {
+            helper.AddPage(pageInfo.page, pageInfo.headerFont, pageInfo.headerText);
+        }
+        helper.WaitForLayout();
+    }));
+
+    constexpr int refreshIterations = 3;
+    results.Write(pagesCount, "Layout.RefreshLayout", defaultAlignment, refreshIterations, Measure([&] {
+        for (int i = 0; i < refreshIterations; ++i) {
+            helper.RefreshLayout();
+            helper.WaitForLayout();
+        }
+    }));
+
+    std::mt19937 random{seed};
+    for (auto alignment : {TImagesViewAlignment::AlignRight, TImagesViewAlignment::AlignHCenter,
+                           TImagesViewAlignment::HorizontalFlow, TImagesViewAlignment::AlignLeft}) {
+        results.Write(pagesCount, "Layout.SetAlignment", alignment, 1, Measure([&] {
+            helper.SetAlignment(alignment);
+            helper.WaitForLayout();
+        }));
+
+        // The same queries as the ones done by the view to paint a frame
+        constexpr int scrollSteps = 1000;
+        size_t visiblePages = 0;
+        results.Write(pagesCount, "Layout.Scroll", alignment, scrollSteps, Measure([&] {
+            for (int i = 0; i < scrollSteps; ++i) {
+                helper.SetVScroll(float(i) / scrollSteps);
+                auto [firstVisible, lastVisible] = helper.QueryVisible(helper.GetViewportRect());
+                visiblePages += lastVisible - firstVisible;
+            }
+        }));
+
+        // Synthetic pages decode nothing, so this is the cost of choosing the pages to decode
+        CDecodeScheduler decodeScheduler;
+        results.Write(pagesCount, "Decode.Schedule", alignment, scrollSteps, Measure([&] {
+            for (int i = 0; i < scrollSteps; ++i) {
+                helper.AddVScroll(-1.f / scrollSteps);
+                decodeScheduler.Schedule(helper, nullptr);
+            }
+        }));
+
+        constexpr int hitTests = 10000;
+        std::uniform_real_distribution<float> x{0.f, 1280.f};
+        std::uniform_real_distribution<float> y{0.f, 720.f};
+        int hitPages = 0;
+        helper.SetVScroll(0.5f);
+        results.Write(pagesCount, "Layout.PageAtPoint", alignment, hitTests, Measure([&] {
+            for (int i = 0; i < hitTests; ++i) {
+                hitPages += helper.PageAtPoint(x(random), y(random)) != -1;
+            }
+        }));
+        helper.SetVScroll(0.f);
+
+        resultsSink += visiblePages + hitPages;
+    }
+
+    // Every delete relayouts the pages after the deleted one, so take them from the middle
+    const int deletes = std::min(100, pagesCount / 2);
+    results.Write(pagesCount, "Layout.DeletePage", defaultAlignment, deletes, Measure([&] {
+        for (int i = 0; i < deletes; ++i) {
+            helper.DeletePage(pageInfos[pagesCount / 2 + i].page);
+            helper.WaitForLayout();
+        }
+    }));
+
+    results.Write(pagesCount, "Layout.ClearPages", defaultAlignment, 1, Measure([&] {
+        helper.ClearPages();
+        helper.WaitForLayout();
+    }));
+}
+
+/// @brief Compare the conversions of decoded pixels to PBGRA done by our kernels with IWICFormatConverter
+static void RunConversionBenchmark(CResultsWriter& results, unsigned seed)
+{
+    // A 12 megapixel photo
+    constexpr UINT width = 4000;
+    constexpr UINT height = 3000;
+    constexpr int iterations = 10;
+    constexpr size_t pixelsCount = size_t(width) * height;
+
+    std::mt19937 random{seed};
+    std::vector<BYTE> sourcePixels(pixelsCount * 4);
+    for (auto& byte : sourcePixels) {
+        byte = BYTE(random());
+    }
+    std::vector<BYTE> pixels(pixelsCount * 4);
+    auto factory = CImagingService::Instance().GetWICFactory();
+
+    struct CConversion {
+        const char* wicName;
+        const char* kernelName;
+        const GUID* format;
+        UINT bytesPerPixel;
+        void (*kernel)(const BYTE* source, BYTE* destination, size_t pixelsCount);
+    };
+    const CConversion conversions[] = {
+        {"Convert.WIC.BGR24", "Convert.Kernel.BGR24", &GUID_WICPixelFormat24bppBGR, 3, [](const BYTE* source, BYTE* destination, size_t count) {
+            ConvertBgrToPbgra(source, destination, count);
+        }},
+        {"Convert.WIC.BGR32", "Convert.Kernel.BGR32", &GUID_WICPixelFormat32bppBGR, 4, [](const BYTE* source, BYTE* destination, size_t count) {
+            std::copy(source, source + count * 4, destination);
+            FillOpaqueAlpha(destination, count);
+        }},
+        {"Convert.WIC.BGRA", "Convert.Kernel.BGRA", &GUID_WICPixelFormat32bppBGRA, 4, [](const BYTE* source, BYTE* destination, size_t count) {
+            std::copy(source, source + count * 4, destination);
+            PremultiplyBgra(destination, count);
+        }},
+        {"Convert.WIC.PBGRA", "Convert.PassThrough.PBGRA", &GUID_WICPixelFormat32bppPBGRA, 4, [](const BYTE* source, BYTE* destination, size_t count) {
+            std::copy(source, source + count * 4, destination);
+        }}
+    };
+
+    for (const auto& conversion : conversions) {
+        const UINT sourceStride = width * conversion.bytesPerPixel;
+        CComPtr<IWICBitmap> sourceBitmap = nullptr;
+        OK(factory->CreateBitmapFromMemory(width, height, *conversion.format, sourceStride, sourceStride * height,
+                                           sourcePixels.data(), &sourceBitmap.ptr));
+
+        // A converter is created for every decode, so its creation is measured too
+        results.WriteConversion(pixelsCount, conversion.wicName, iterations, Measure([&] {
+            for (int i = 0; i < iterations; ++i) {
+                CComPtr<IWICFormatConverter> converter = nullptr;
+                OK(factory->CreateFormatConverter(&converter.ptr));
+                OK(converter->Initialize(sourceBitmap, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, NULL, 0.f,
+                                         WICBitmapPaletteTypeMedianCut));
+                OK(converter->CopyPixels(nullptr, width * 4, pixels.size(), pixels.data()));
+            }
+        }));
+        results.WriteConversion(pixelsCount, conversion.kernelName, iterations, Measure([&] {
+            for (int i = 0; i < iterations; ++i) {
+                conversion.kernel(sourcePixels.data(), pixels.data(), pixelsCount);
+            }
+        }));
+        resultsSink += pixels[random() % pixels.size()];
+    }
+}
+
+static std::vector<int> ParsePagesCounts(const wchar_t* list)
+{
+    std::vector<int> counts;
+    wchar_t* end = nullptr;
+    for (auto it = list; *it != L'\0'; it = *end == L',' ? end + 1 : end) {
+        const long count = std::wcstol(it, &end, 10);
+        if (end == it) {
+            break;
+        }
+        if (count > 0) {
+            counts.push_back(count);
+        }
+    }
+    return counts;
+}
+
+/// Usage: LayoutBenchmark [--pages 1000,100000,1000000] [--sizes fixed|uniform|mixed] [--text directwrite|fixed]
+///                        [--conversion on|off] [--seed N]
+int wmain(int argc, wchar_t** argv)
+{
+    std::vector<int> pagesCounts{1000, 100000, 1000000};
+    TSizeDistribution distribution = TSizeDistribution::Mixed;
+    bool isFixedTextMetrics = false;
+    bool isConversionMeasured = true;
+    unsigned seed = 42;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::wstring option = argv[i];
+        const wchar_t* value = argv[i + 1];
+        if (option == L"--pages") {
+            pagesCounts = ParsePagesCounts(value);
+        } else if (option == L"--sizes") {
+            const std::wstring name = value;
+            distribution = name == L"fixed" ? TSizeDistribution::Fixed
+                         : name == L"uniform" ? TSizeDistribution::Uniform
+                         : TSizeDistribution::Mixed;
+        } else if (option == L"--text") {
+            isFixedTextMetrics = std::wstring{value} == L"fixed";
+        } else if (option == L"--conversion") {
+            isConversionMeasured = std::wstring{value} != L"off";
+        } else if (option == L"--seed") {
+            seed = std::wcstoul(value, nullptr, 10);
+        } else {
+            std::wcerr << L"Unknown option " << option << L"\n";
+            return 1;
+        }
+    }
+
+    OK(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+    {
+        CResultsWriter results{distribution, isFixedTextMetrics, seed};
+        for (int pagesCount : pagesCounts) {
+            RunBenchmark(results, pagesCount, distribution, isFixedTextMetrics, seed);
+        }
+        if (isConversionMeasured) {
+            RunConversionBenchmark(results, seed);
+        }
+    }
+    CoUninitialize();
+
+    return 0;
+}
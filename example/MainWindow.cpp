@@ -1,6 +1,5 @@
 #include <MainWindow.h>
 
-#include <DocumentFromDisk.h>
 
 #include <shellapi.h>
 #include <winuser.rh>
@@ -102,16 +101,14 @@ void CMainWindow::AttachHandle(HWND _window)
 
     imagesView.reset(new CDocumentView{window});
     model = new CBasicDocumentModel{};
-    const wchar_t *files[] = {
+    imagesView->SetModel(model);
+    loader.reset(new CDocumentsLoader{model});
+    loader->AddFiles({
         L"../bin/pic1.png",
         L"../bin/pic2.jpeg",
         L"../bin/pic3.jpg",
         L"../bin/pic4.jpg"
-    };
-    for (auto file: files) {
-        model->AddDocument(new CDocumentFromDisk{file});
-    }
-    imagesView->SetModel(model);
+    });
     
 
     layoutGroup = CreateWindowEx(WS_EX_WINDOWEDGE,
@@ -213,16 +210,25 @@ void CMainWindow::OnDropfiles(WPARAM wParam, LPARAM)
 
     std::vector<wchar_t> wcharsBuffer;
     wcharsBuffer.resize(4096, 0);
+    std::vector<std::wstring> files;
     for (int i = 0; i < filesCount; ++i) {
         int pathLength = DragQueryFile(dropHandle, i, nullptr, 0);
         if (pathLength > wcharsBuffer.size()) {
             wcharsBuffer.resize(pathLength + 1);
         }
         assert(DragQueryFile(dropHandle, i, wcharsBuffer.data(), wcharsBuffer.size()));
-        model->AddDocument(new CDocumentFromDisk{wcharsBuffer.data()});
+        const DWORD attributes = GetFileAttributesW(wcharsBuffer.data());
+        if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0) {
+            // Files dropped before the directory go first
+            loader->AddFiles(files);
+            files.clear();
+            loader->AddDirectory(wcharsBuffer.data(), true);
+        } else {
+            files.push_back(wcharsBuffer.data());
+        }
     }
+    loader->AddFiles(files);
     DragFinish(dropHandle);
-    imagesView->Redraw();
 }
 
 void CMainWindow::OnCommand(WPARAM wParam, LPARAM lParam)
@@ -257,6 +263,7 @@ void CMainWindow::OnKeydown(WPARAM wParam, LPARAM)
             auto pagePtr = reinterpret_cast<IPage*>(model->GetData(page, TDocumentModelRoles::PageRole));
             docs.insert(pagePtr->GetDocument());
         }
+        CDocumentsModelUpdateScope update{model};
         for (auto doc : docs) {
             model->DeleteDocument(doc);
         }
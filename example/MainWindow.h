@@ -3,6 +3,7 @@
 
 #include <DocumentView.h>
 #include <BasicDocumentModel.h>
+#include <DocumentsLoader.h>
 
 #include <memory>
 
@@ -36,6 +37,8 @@ private:
 
     std::unique_ptr<CDocumentView> imagesView;
     CBasicDocumentModel* model = nullptr;
+    /// Opens files in background, declared after the view so it is destroyed before the view's model
+    std::unique_ptr<CDocumentsLoader> loader;
 };
 
 #endif
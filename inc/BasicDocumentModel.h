@@ -4,8 +4,11 @@
 #include <ComPtr.h>
 #include <IDocumentModel.h>
 
-#include <vector>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 struct IDWriteTextFormat;
 
@@ -35,6 +38,21 @@ public:
     /// @copydoc IDocumentsModel::GetData
     void* GetData(int index, TDocumentModelRoles role) const override;
 
+    /// @copydoc IDocumentsModel::GetHeaderText
+    std::wstring_view GetHeaderText(int index) const override { return headerTexts.at(index); }
+
+    /// @copydoc IDocumentsModel::GetPages
+    void GetPages(int first, int count, CPageInfo* out) const override;
+
+    /// @copydoc IDocumentsModel::BeginUpdate
+    void BeginUpdate() override;
+
+    /// @copydoc IDocumentsModel::EndUpdate
+    void EndUpdate() override;
+
+    /// @copydoc IDocumentsModel::RetainDeletedDocument
+    std::shared_ptr<IDocument> RetainDeletedDocument(const IDocument* document) override;
+
     /// @brief Add document to the model. Model takes ownership.
     /// @param document Pointer to the document object
     void AddDocument(IDocument* document);
@@ -47,11 +65,35 @@ public:
     /// @param document Weak pointer to the document
     void DeleteDocument(const IDocument* document);
 
+protected:
+    /// @brief Forwards document changes, e.g. pages that have finished loading, to the subscribers
+    void OnChanged(IDocument* document) override;
+
 private:
     CComPtr<IDWriteTextFormat> headerFont;
-    ID2D1RenderTarget* currentTarget = nullptr;
     std::vector<std::unique_ptr<IDocument>> documents;
     std::vector<IPage*> images;
+    /// Header text of every page, points into documentHeaders
+    std::vector<std::wstring_view> headerTexts;
+    /// Null-terminated headers of all document pages, formatted once when the document is added
+    std::unordered_map<const IDocument*, std::wstring> documentHeaders;
+
+    /// @brief Deleted document with the headers of its pages
+    struct CDeletedDocument
+    {
+        std::unique_ptr<IDocument> document;
+        /// Extracted from documentHeaders, so the header texts do not move
+        std::unordered_map<const IDocument*, std::wstring>::node_type headers;
+    };
+    /// Documents whose deletion is not notified yet or is being notified
+    std::vector<std::shared_ptr<CDeletedDocument>> deletedDocuments;
+
+    // Update transaction state
+    int updateDepth = 0;
+    CDocumentsModelChanges pendingChanges;
+
+    void deleteDocument(std::vector<std::unique_ptr<IDocument>>::iterator document);
+    void formatHeaders(const IDocument& document);
 };
 
 #endif
\ No newline at end of file
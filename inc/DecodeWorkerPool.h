@@ -0,0 +1,96 @@
+#ifndef D2DILV_DECODE_WORKER_POOL_H
+#define D2DILV_DECODE_WORKER_POOL_H
+
+#include <GenericNotifier.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// @brief Listener of CDecodeWorkerPool, e.g. a window that dispatches completions on its thread
+struct IDecodeCompletionListener {
+    virtual ~IDecodeCompletionListener() = default;
+
+    /// @brief Called on a worker thread when completions are ready to be dispatched.
+    /// It is called once until DispatchCompleted runs, so posting a window message from it is enough.
+    virtual void OnCompletionsReady() = 0;
+};
+
+/// @brief Process-wide pool of threads that decode page pixels.
+/// A job runs on a worker thread and returns a completion, which is run on the UI thread
+/// by DispatchCompleted, so GPU resources are created and page callbacks fire on the UI thread only.
+class CDecodeWorkerPool {
+public:
+    /// @brief Runs on the UI thread with the results of a finished job
+    using CCompletion = std::function<void()>;
+    /// @brief Runs on a worker thread, must not touch anything the UI thread uses
+    using CDecodeJob = std::function<CCompletion()>;
+
+    /// @brief Get the pool, it is started on first use
+    static CDecodeWorkerPool& Instance();
+
+    ~CDecodeWorkerPool();
+
+    CDecodeWorkerPool(const CDecodeWorkerPool&) = delete;
+    CDecodeWorkerPool& operator=(const CDecodeWorkerPool&) = delete;
+
+    /// @brief Queue a job
+    /// @param owner Object the job belongs to, see Cancel. Pages use themselves (IPage*), so the view can prioritize them.
+    /// @param job Job to run on a worker thread
+    void Submit(const void* owner, CDecodeJob job);
+
+    /// @brief Drop queued jobs and not dispatched completions of the owner, wait for its running jobs.
+    /// Call it before the owner is destroyed.
+    void Cancel(const void* owner);
+
+    /// @brief Drop queued jobs of the owner without waiting. The running ones finish and their completions are dispatched.
+    void Drop(const void* owner);
+
+    /// @brief Set the order jobs are taken in. Jobs of the listed owners run first, in the order of the list,
+    /// then the jobs of the other owners in the order they were submitted.
+    /// @param owners Owners from the most to the least urgent one
+    void SetPriorities(const std::vector<const void*>& owners);
+
+    /// @brief Run completions of the finished jobs. Call it on the UI thread.
+    /// Completions of the owners cancelled by the ones run before are skipped.
+    void DispatchCompleted();
+
+    /// @brief Subscribe to completions. Every listener is notified, whichever of them dispatches first runs all of them.
+    /// @param listener Listener, is notified right away if some completions are ready
+    void AddCompletionListener(IDecodeCompletionListener* listener);
+
+    /// @brief Unsubscribe from completions, the listener is not called after it returns
+    void RemoveCompletionListener(IDecodeCompletionListener* listener);
+
+private:
+    CDecodeWorkerPool();
+
+    std::mutex mutex;
+    /// Signals workers about new jobs and Cancel about finished ones
+    std::condition_variable jobsChanged;
+    std::deque<std::pair<const void*, CDecodeJob>> jobs;
+    /// Rank of owners set by SetPriorities, lower runs first
+    std::unordered_map<const void*, size_t> priorities;
+    /// Owners of the jobs being run right now, one per worker
+    std::vector<const void*> runningOwners;
+    std::vector<std::pair<const void*, CCompletion>> completions;
+    /// Number of DispatchCompleted calls running, a completion may dispatch again
+    size_t dispatchDepth = 0;
+    /// Owners cancelled while completions are dispatched, their completions are skipped
+    std::vector<const void*> cancelledOwners;
+    CSimpleNotifier<IDecodeCompletionListener> completionListeners;
+    bool isStopping = false;
+    std::vector<std::thread> workers;
+
+    size_t rankOf(const void* owner) const;
+    /// @brief Most urgent job whose owner has no running job, jobs.end() if there is none
+    std::deque<std::pair<const void*, CDecodeJob>>::iterator nextJob();
+    void runWorker(size_t workerIndex);
+};
+
+#endif
@@ -6,11 +6,12 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
+class CFrameCache;
+class CMappedFile;
 class CWICImage;
 
-struct IWICImagingFactory;
-
 class CDocumentFromDisk : public IDocument
 {
 public:
@@ -22,10 +23,17 @@ public:
     const IPage* GetPage(int index) const override;
     int GetIndexOf(const IPage* page) const override;
 
+protected:
+    void OnLoadingFinished() override;
+
 private:
     std::wstring fileName;
-    CComPtr<IWICImagingFactory> wicFactory;
-    std::vector<std::unique_ptr<CWICImage>> images;
+    /// View of the file the decoder reads from, nullptr if the file is read through a WIC file stream
+    std::unique_ptr<CMappedFile> mappedFile;
+    /// Frames of the file and their headers, pages open them to decode pixels
+    std::unique_ptr<CFrameCache> frames;
+    /// One per frame, created by GetPage on first access
+    mutable std::vector<std::unique_ptr<CWICImage>> images;
 };
 
 #endif
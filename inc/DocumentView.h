@@ -3,6 +3,7 @@
 
 #include <Defines.h>
 #include <ComPtr.h>
+#include <DecodeWorkerPool.h>
 #include <IDocumentModel.h>
 #include <DocumentViewParams.h>
 #include <SelectionModel.h>
@@ -16,10 +17,11 @@
 /// @brief Forward declarations
 namespace DocumentViewPrivate {
 class CDocumentLayoutHelper;
+class CDecodeScheduler;
 }
 
 /// @brief Viewer of the document model. Subscribes to model's notifications.
-class CDocumentView : private IDocumentsModelCallback, private ISelectionModelCallback {
+class CDocumentView : private IDocumentsModelCallback, private ISelectionModelCallback, private IDecodeCompletionListener {
 public:
     /// @brief Constructor
     /// @param parent Parent window to attach
@@ -41,7 +43,7 @@ public:
     /// @brief Schedule view redraw
     void Redraw();
 
-    /// @brief Set new model. The view takes ownership of it and subscribes to its' updates.
+    /// @brief Set new model. The view takes ownership of it and subscribes to its updates.
     /// Unsubscribes from old model if exists.
     /// @param model Pointer to model
     void SetModel(IDocumentsModel* model);
@@ -67,6 +69,19 @@ public:
     /// @param alignment New pages alignment
     void SetAlignment(TImagesViewAlignment alignment);
 
+    /// @brief Pages are laid out in background, check if the painted layout reflects all changes
+    /// @return True if the layout is current, false if a newer one is being computed
+    bool IsLayoutCurrent() const;
+
+    /// @brief Set how many bytes page bitmaps may take, the least recently drawn ones are released over it.
+    /// Visible pages are always kept, even if they don't fit.
+    /// @param bytes Budget in bytes
+    void SetBitmapBudget(size_t bytes);
+
+    /// @brief Get statistics of the page bitmaps, e.g. to tune the budget
+    /// @return Counters since the view was created
+    CBitmapResidencyCounters GetBitmapResidencyCounters() const;
+
 protected:
     // Windows messages
     void OnDraw(WPARAM, LPARAM);
@@ -74,12 +89,18 @@ protected:
     void OnScroll(WPARAM, LPARAM);
     void OnLButtonUp(WPARAM, LPARAM);
     void OnDestroy(WPARAM, LPARAM);
+    void OnDecodeCompleted(WPARAM, LPARAM);
 
-    void OnDocumentAdded(IDocument* doc) override;
+    void OnDocumentChanged(IDocument* doc) override;
     void OnDocumentDeleted(IDocument* doc) override;
+    void OnPagesInserted(int firstIndex, int count) override;
+    void OnModelUpdated(const CDocumentsModelChanges& changes) override;
 
     void OnSelectionChanged(const std::vector<int>& /*newSelection*/) override { this->Redraw(); }
 
+    /// @brief Called on a worker thread, posts WM_DECODE_COMPLETED to the window
+    void OnCompletionsReady() override;
+
 private:
     HWND window = NULL;
 
@@ -88,6 +109,7 @@ private:
 
     CComPtr<ID2D1Factory1> d2dFactory = nullptr;
     std::unique_ptr<DocumentViewPrivate::CDocumentLayoutHelper> helper;
+    std::unique_ptr<DocumentViewPrivate::CDecodeScheduler> decodeScheduler;
 
     // Direct2D objects
     struct CSurfaceContext {
@@ -113,6 +135,12 @@ private:
 
     /// @brief Adjusts the size of the render target
     void resize(int width, int height);
+
+    /// @brief Delete all pages from the layout and give up the model, it is released once the layout drops the pages
+    void clearPages();
+
+    /// @brief Called on the layout thread when a new layout can be painted
+    void onLayoutPublished();
 };
 
 #endif
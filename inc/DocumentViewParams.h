@@ -11,6 +11,21 @@ enum class TImagesViewAlignment {
 #include <d2d1.h>
 #include <d2d1helper.h>
 
+#include <cstddef>
+#include <cstdint>
+
+/// @brief Statistics of the page bitmaps the view keeps
+struct CBitmapResidencyCounters {
+    /// Draws of visible pages whose bitmap was resident
+    uint64_t hits = 0;
+    /// Draws of visible pages whose bitmap was not resident yet
+    uint64_t misses = 0;
+    /// Bitmaps released to stay within the budget or because they went far from the viewport
+    uint64_t evictions = 0;
+    /// Bytes of the resident bitmaps
+    size_t residentBytes = 0;
+};
+
 #define TImagesViewColor D2D1::ColorF::Enum
 
 #endif
@@ -0,0 +1,114 @@
+#ifndef D2DILV_DOCUMENTS_LOADER_H
+#define D2DILV_DOCUMENTS_LOADER_H
+
+#include <GenericNotifier.h>
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class CBasicDocumentModel;
+struct IDocument;
+
+/// @brief Progress of opening files by CDocumentsLoader
+struct CDocumentsLoadProgress {
+    /// Files passed to the loader since it was idle
+    size_t totalCount = 0;
+    /// Files opened or failed to open so far
+    size_t doneCount = 0;
+    /// Documents added to the model
+    size_t insertedCount = 0;
+    /// Files that couldn't be opened or have no pages, they are not added to the model
+    size_t failedCount = 0;
+    /// Time from the start of loading until the first document was added to the model, zero until then
+    std::chrono::steady_clock::duration timeToFirstPage{};
+};
+
+/// @brief Notifications of CDocumentsLoader, sent on the UI thread
+struct IDocumentsLoaderCallback
+{
+    /// @brief Sent every time a batch of documents is added to the model
+    virtual void OnLoadingProgress(const CDocumentsLoadProgress&) {}
+
+    /// @brief Sent when all the files are done
+    virtual void OnLoadingFinished(const CDocumentsLoadProgress&) {}
+};
+
+/// @brief Opens many files in background and adds them to a model in the order they were given.
+/// Files are opened and frame headers of their pages are read on CDecodeWorkerPool, a few at a time.
+/// The opened documents are added to the model in batches by the pool completions,
+/// so they are dispatched on the UI thread by the view the model is shown in.
+class CDocumentsLoader : public CSimpleNotifier<IDocumentsLoaderCallback>
+{
+public:
+    /// @brief Creates a document of a file, runs on a worker thread
+    /// @return Document or nullptr if the file can't be opened
+    using CDocumentFactory = std::function<IDocument*(const std::wstring& path)>;
+
+    /// @brief Constructor
+    /// @param model Model the documents are added to, must outlive the loader
+    /// @param factory Document factory, CDocumentFromDisk is created if it is empty
+    explicit CDocumentsLoader(CBasicDocumentModel* model, CDocumentFactory factory = {});
+
+    /// @brief Destructor, cancels loading
+    ~CDocumentsLoader();
+
+    CDocumentsLoader(const CDocumentsLoader&) = delete;
+    CDocumentsLoader& operator=(const CDocumentsLoader&) = delete;
+
+    /// @brief Open files in background. They are added to the model after the files passed before.
+    /// @param paths Paths to the files
+    void AddFiles(const std::vector<std::wstring>& paths);
+
+    /// @brief Open files of a directory in background, in the order Explorer sorts them by name
+    /// @param path Path to the directory
+    /// @param isRecursive Open files of subdirectories too, after the files of the directory
+    void AddDirectory(const std::wstring& path, bool isRecursive);
+
+    /// @brief Stop loading. Documents added to the model stay there, the rest are dropped.
+    void Cancel();
+
+    /// @brief Check if there are files being opened
+    bool IsLoading() const { return !files.empty(); }
+
+    /// @brief Get progress of the current loading, or of the last one if it is finished
+    const CDocumentsLoadProgress& GetProgress() const { return progress; }
+
+private:
+    /// Files opened at the same time, more of them only fight for the disk and leave no workers to decode pages
+    static constexpr size_t MaxOpensInFlight = 4;
+    /// Documents are added to the model in batches of this size, so the view relayouts once per batch
+    static constexpr size_t BatchSize = 64;
+
+    /// @brief File being loaded, its address is the owner of the open job in the pool
+    struct CFile {
+        std::wstring path;
+        /// Set by the open job
+        std::unique_ptr<IDocument> document;
+        /// Set when the job completes on the UI thread
+        bool isOpened = false;
+    };
+
+    CBasicDocumentModel* model;
+    CDocumentFactory factory;
+    /// Files in the order their documents are added to the model, deque keeps the addresses stable
+    std::deque<CFile> files;
+    /// Index of the first file whose document is not added to the model yet
+    size_t firstPending = 0;
+    /// Index of the first file that is not submitted to the pool yet
+    size_t firstUnsubmitted = 0;
+    size_t openingCount = 0;
+    std::chrono::steady_clock::time_point start;
+    CDocumentsLoadProgress progress;
+
+    void submitOpens();
+    void onOpened(CFile& file);
+    /// @brief Add the opened documents that are next in order to the model
+    void insertOpened();
+};
+
+#endif
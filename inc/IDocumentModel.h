@@ -3,6 +3,10 @@
 
 #include <GenericNotifier.h>
 
+#include <memory>
+#include <string_view>
+#include <vector>
+
 #ifdef __MINGW32__
 #include <windef.h> // SIZE
 #else
@@ -13,6 +17,8 @@
 // Direct2D
 struct ID2D1Bitmap;
 struct ID2D1RenderTarget;
+// DirectWrite
+struct IDWriteTextFormat;
 // Document interface
 struct IDocument;
 /////////////////////////////
@@ -21,7 +27,7 @@ struct IDocument;
 enum class TDocumentModelRoles
 {
     HeaderFontRole, // IDWriteTextFormat
-    HeaderTextRole, // LPCWSTR
+    HeaderTextRole, // LPCWSTR, model-owned
     ToolbarRole, // Toolbar resources
     PageRole // IDocumentPage
 };
@@ -63,16 +69,37 @@ struct IPage : CSimpleNotifier<IPageCallback>
     /// @return Page size
     virtual SIZE GetPageSize() const = 0;
 
-    /// @brief Create render-target-dependent bitmap
+    /// @brief Create render-target-dependent bitmap. Does nothing if the bitmap for this target
+    /// exists or is being loaded, so it can be called every time the page is about to be drawn.
+    /// The bitmap may be smaller than the page when the page is drawn zoomed out.
     /// @param renderTarget Render target where the page is going to be drawn
-    virtual void PrepareBitmapForTarget(ID2D1RenderTarget* renderTarget) = 0;
+    /// @param scale Target pixels per page pixel the page is drawn with
+    virtual void PrepareBitmapForTarget(ID2D1RenderTarget* renderTarget, float scale) = 0;
     virtual ID2D1Bitmap* GetPageBitmap() const = 0;
+
+    /// @brief Release the bitmap and drop its loading if it is not finished yet.
+    /// The page is LOADING until PrepareBitmapForTarget is called again.
+    virtual void ReleaseBitmap() = 0;
+};
+
+/// @brief Page data needed to lay the page out, filled by IDocumentsModel::GetPages
+struct CPageInfo
+{
+    /// Model-owned page
+    const IPage* page = nullptr;
+    SIZE size = {0, 0};
+    /// Model-owned header text, see IDocumentsModel::GetHeaderText
+    std::wstring_view headerText;
+    /// Model-owned header font
+    IDWriteTextFormat* headerFont = nullptr;
 };
 
 /// @brief IDocument notifications
 struct IDocumentCallback
 {
-    virtual void OnChanged() {}
+    /// @brief Sent when the document or its pages change, e.g. a page has finished loading
+    /// @param document Document that changed
+    virtual void OnChanged(IDocument* /*document*/) {}
 };
 
 /// @brief Document interface. Implementations should subscribe to page changes.
@@ -101,12 +128,35 @@ struct IDocument : IPageCallback, CSimpleNotifier<IDocumentCallback>
     virtual int GetIndexOf(const IPage* page) const = 0;
 };
 
+/// @brief Merged changes made to a model during an update transaction
+struct CDocumentsModelChanges
+{
+    /// Documents added during the update and still in the model
+    std::vector<IDocument*> addedDocuments;
+    /// Documents deleted during the update. They stay alive until the notification returns,
+    /// see IDocumentsModel::RetainDeletedDocument to keep them longer.
+    std::vector<IDocument*> deletedDocuments;
+    /// Index of the first page inserted during the update
+    int firstInsertedPage = 0;
+    /// Number of consecutive pages inserted during the update
+    int insertedPagesCount = 0;
+};
+
 /// @brief IDocumentsModel notifications
 struct IDocumentsModelCallback
 {
     virtual void OnDocumentChanged(IDocument*) {}
     virtual void OnDocumentAdded(IDocument*) {}
     virtual void OnDocumentDeleted(IDocument*) {}
+
+    /// @brief Sent when pages are inserted into the model
+    /// @param firstIndex Index of the first inserted page
+    /// @param count Number of consecutive inserted pages
+    virtual void OnPagesInserted(int /*firstIndex*/, int /*count*/) {}
+
+    /// @brief Sent instead of the notifications above when an update transaction ends
+    /// @param changes All changes made during the transaction
+    virtual void OnModelUpdated(const CDocumentsModelChanges& /*changes*/) {}
 };
 
 /// @brief DocumentsModel interface. Implementations should subscribe to document changes.
@@ -114,7 +164,8 @@ struct IDocumentsModel : IDocumentCallback, CSimpleNotifier<IDocumentsModelCallb
 {
     virtual ~IDocumentsModel() = default;
 
-    /// @brief Create bitmaps for render target
+    /// @brief Set render target the pages are drawn to. Bitmaps of the previous one are released,
+    /// the view creates bitmaps of the pages it is going to draw with IPage::PrepareBitmapForTarget.
     /// @param renderTarget New render target where documents will be drawn to
     virtual void CreateImages(ID2D1RenderTarget* renderTarget) = 0;
 
@@ -136,6 +187,50 @@ struct IDocumentsModel : IDocumentCallback, CSimpleNotifier<IDocumentsModelCallb
     /// @param role Data role
     /// @return Model-owned pointer to object
     virtual void* GetData(int index, TDocumentModelRoles role) const = 0;
+
+    /// @brief Get page header text without copying it
+    /// @param index 0...TotalPageCount - 1
+    /// @return Model-owned text, valid until the page is deleted from the model
+    virtual std::wstring_view GetHeaderText(int index) const = 0;
+
+    /// @brief Get data of consecutive pages in one call
+    /// @param first Index of the first page
+    /// @param count Number of pages, first + count <= TotalPageCount
+    /// @param out Array of at least count elements
+    virtual void GetPages(int first, int count, CPageInfo* out) const = 0;
+
+    /// @brief Start an update transaction. Until the matching EndUpdate, change notifications
+    /// are queued and merged. Transactions can be nested, the outermost one sends the changes.
+    virtual void BeginUpdate() = 0;
+
+    /// @brief Finish an update transaction and send IDocumentsModelCallback::OnModelUpdated
+    virtual void EndUpdate() = 0;
+
+    /// @brief Share ownership of a deleted document, so its pages and their header texts stay valid
+    /// until the returned pointer is released. Can be called while the deletion is notified.
+    /// @param document Document passed to OnDocumentDeleted or OnModelUpdated
+    /// @return Pointer to the document, nullptr if the document is not being deleted
+    virtual std::shared_ptr<IDocument> RetainDeletedDocument(const IDocument* document) = 0;
+};
+
+/// @brief Scoped update transaction of a documents model
+class CDocumentsModelUpdateScope {
+public:
+    explicit CDocumentsModelUpdateScope(IDocumentsModel* _model) : model{_model}
+    {
+        model->BeginUpdate();
+    }
+
+    ~CDocumentsModelUpdateScope()
+    {
+        model->EndUpdate();
+    }
+
+    CDocumentsModelUpdateScope(const CDocumentsModelUpdateScope&) = delete;
+    CDocumentsModelUpdateScope& operator=(const CDocumentsModelUpdateScope&) = delete;
+
+private:
+    IDocumentsModel* model;
 };
 
 #endif
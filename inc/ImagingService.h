@@ -0,0 +1,64 @@
+#ifndef D2DILV_IMAGING_SERVICE_H
+#define D2DILV_IMAGING_SERVICE_H
+
+#include <ComPtr.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+struct IDWriteFactory;
+struct IWICImagingFactory;
+
+/// @brief Time spent in WIC by all threads
+struct CImagingTimings {
+    /// Files opened and the total time of opening them
+    uint64_t opens = 0;
+    double openMs = 0.0;
+    /// Pages decoded and the total time of decoding them
+    uint64_t decodes = 0;
+    double decodeMs = 0.0;
+};
+
+/// @brief Process-wide factories of imaging and text objects.
+/// Creating a factory is a COM activation, so documents and views share these instead of creating their own.
+class CImagingService {
+public:
+    /// @brief Get the service, factories are created on first use
+    static CImagingService& Instance();
+
+    CImagingService(const CImagingService&) = delete;
+    CImagingService& operator=(const CImagingService&) = delete;
+
+    /// @brief Get the WIC factory. It can be used from any thread, COM must be initialized on the calling one.
+    IWICImagingFactory* GetWICFactory();
+
+    /// @brief Get the DirectWrite factory. It can be used from any thread.
+    IDWriteFactory* GetDirectWriteFactory();
+
+    /// @brief Account a file open, e.g. creating a decoder and reading frame headers
+    void RecordOpen(std::chrono::steady_clock::duration elapsed);
+
+    /// @brief Account decoding of a page
+    void RecordDecode(std::chrono::steady_clock::duration elapsed);
+
+    /// @brief Get the timings since the process start
+    CImagingTimings GetTimings() const;
+
+private:
+    CImagingService() = default;
+
+    std::once_flag wicFactoryCreated;
+    /// Never released, statics are destroyed after CoUninitialize
+    IWICImagingFactory* wicFactory = nullptr;
+    std::once_flag directWriteFactoryCreated;
+    CComPtr<IDWriteFactory> directWriteFactory;
+
+    std::atomic<uint64_t> opens{0};
+    std::atomic<uint64_t> openNs{0};
+    std::atomic<uint64_t> decodes{0};
+    std::atomic<uint64_t> decodeNs{0};
+};
+
+#endif
@@ -44,6 +44,7 @@ public:
 
 protected:
     void OnDocumentDeleted(IDocument* doc) override;
+    void OnModelUpdated(const CDocumentsModelChanges& changes) override;
 
 private:
     IDocumentsModel* model = nullptr;
@@ -51,6 +52,7 @@ private:
     std::unordered_map<int, void*> indexToPage;
 
     void selectOneActive(int index);
+    void deselectPagesOf(const IDocument* doc);
 };
 
 #endif
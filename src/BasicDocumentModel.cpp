@@ -1,34 +1,22 @@
 #include <BasicDocumentModel.h>
 
 #include <Defines.h>
+#include <ImagingService.h>
 
 #include <wincodec.h>
 #include <d2d1_1.h>
 #include <dwrite.h>
 #include <shlwapi.h>
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 
-static auto DirectWriteFactory()
-{
-    static CComPtr<IDWriteFactory> factory = nullptr;
-    if (factory == nullptr)
-    {
-        OK(DWriteCreateFactory(
-                DWRITE_FACTORY_TYPE_ISOLATED, __uuidof(IDWriteFactory),
-                reinterpret_cast<IUnknown**>(&factory.ptr)
-            )
-        );
-    }
-    return factory.ptr;
-}
-
 CBasicDocumentModel::CBasicDocumentModel()
 {
     TRACE()
 
-    auto factory = DirectWriteFactory();
+    auto factory = CImagingService::Instance().GetDirectWriteFactory();
     OK(factory->CreateTextFormat(
         L"DejaVu Serif",
         nullptr,
@@ -46,14 +34,14 @@ CBasicDocumentModel::~CBasicDocumentModel()
     TRACE()
 }
 
-void CBasicDocumentModel::CreateImages(ID2D1RenderTarget* renderTarget)
+void CBasicDocumentModel::CreateImages(ID2D1RenderTarget* /*renderTarget*/)
 {
     TRACE()
 
+    // Bitmaps are created on demand, only for the pages that are going to be drawn
     for (auto& page : images) {
-        page->PrepareBitmapForTarget(renderTarget);
+        page->ReleaseBitmap();
     }
-    currentTarget = renderTarget;
 }
 
 void* CBasicDocumentModel::GetData(int index, TDocumentModelRoles role) const
@@ -65,20 +53,8 @@ void* CBasicDocumentModel::GetData(int index, TDocumentModelRoles role) const
     case TDocumentModelRoles::HeaderFontRole:
         return headerFont.ptr;
     case TDocumentModelRoles::HeaderTextRole:
-    {
-        const auto& image = images.at(index);
-        auto document = image->GetDocument();
-        auto documentName = ::PathFindFileNameW(document->GetName());
-        int indexInDocument = document->GetIndexOf(image);
-        
-        wchar_t pageTitleBuffer[4096] = {0};
-        wsprintf(pageTitleBuffer, L"%s %d of %d", documentName, indexInDocument + 1, document->GetPagesCount());
-#ifdef __MINGW32__
-        return wcsdup(pageTitleBuffer);
-#else
-        return _wcsdup( pageTitleBuffer );
-#endif
-    }
+        // Header texts are null-terminated in documentHeaders
+        return const_cast<wchar_t*>(headerTexts.at(index).data());
     case TDocumentModelRoles::ToolbarRole:
         return nullptr;
     case TDocumentModelRoles::PageRole:
@@ -89,6 +65,63 @@ void* CBasicDocumentModel::GetData(int index, TDocumentModelRoles role) const
     return nullptr;
 }
 
+void CBasicDocumentModel::GetPages(int first, int count, CPageInfo* out) const
+{
+    TRACE()
+
+    assert(0 <= first && count >= 0 && first + count <= (int)images.size());
+    for (int i = 0; i < count; ++i) {
+        const auto page = images[first + i];
+        out[i] = CPageInfo{page, page->GetPageSize(), headerTexts[first + i], headerFont.ptr};
+    }
+}
+
+void CBasicDocumentModel::BeginUpdate()
+{
+    TRACE()
+
+    ++updateDepth;
+}
+
+void CBasicDocumentModel::EndUpdate()
+{
+    TRACE()
+
+    assert(updateDepth > 0);
+    if (--updateDepth != 0) {
+        return;
+    }
+
+    // Pages are always appended, so the ones added during the update are the last ones
+    CDocumentsModelChanges changes = std::move(pendingChanges);
+    pendingChanges = CDocumentsModelChanges{};
+    changes.firstInsertedPage = images.size() - changes.insertedPagesCount;
+
+    if (changes.addedDocuments.empty() && changes.deletedDocuments.empty()) {
+        return;
+    }
+    Notify<&IDocumentsModelCallback::OnModelUpdated>(changes);
+
+    // The deleted documents are destroyed here unless the subscribers retained them
+    deletedDocuments.clear();
+}
+
+std::shared_ptr<IDocument> CBasicDocumentModel::RetainDeletedDocument(const IDocument* document)
+{
+    TRACE()
+
+    auto findRes = std::find_if(deletedDocuments.begin(), deletedDocuments.end(),
+        [document](const auto& deleted) {
+            return deleted->document.get() == document;
+        }
+    );
+    if (findRes == deletedDocuments.end()) {
+        return nullptr;
+    }
+    // Owns the whole entry, so the header texts are kept too
+    return std::shared_ptr<IDocument>{*findRes, (*findRes)->document.get()};
+}
+
 void CBasicDocumentModel::AddDocument(IDocument* document)
 {
     TRACE()
@@ -96,13 +129,22 @@ void CBasicDocumentModel::AddDocument(IDocument* document)
     documents.emplace_back(document);
     auto& lastAdded = *documents.back();
     lastAdded.Subscribe(this);
+    const int firstIndex = images.size();
     for (int i = 0; i < lastAdded.GetPagesCount(); ++i) {
         this->images.push_back(const_cast<IPage*>(lastAdded.GetPage(i)));
-        if (currentTarget != nullptr) {
-            this->images.back()->PrepareBitmapForTarget(currentTarget);
-        }
     }
+    formatHeaders(lastAdded);
+
+    if (updateDepth > 0) {
+        pendingChanges.addedDocuments.push_back(document);
+        pendingChanges.insertedPagesCount += lastAdded.GetPagesCount();
+        return;
+    }
+
     Notify<&IDocumentsModelCallback::OnDocumentAdded>(document);
+    if (lastAdded.GetPagesCount() != 0) {
+        Notify<&IDocumentsModelCallback::OnPagesInserted>(firstIndex, lastAdded.GetPagesCount());
+    }
 }
 
 void CBasicDocumentModel::DeleteDocument(int index)
@@ -110,13 +152,7 @@ void CBasicDocumentModel::DeleteDocument(int index)
     TRACE()
 
     assert(0 <= index && index < (int)documents.size());
-    std::unique_ptr<IDocument> released{documents[index].release()};
-    released->Unsubscribe(this);
-    documents.erase(documents.begin() + index);
-    images.erase(std::remove_if(images.begin(), images.end(), [&released](const auto& imagePtr) {
-        return imagePtr->GetDocument() == released.get();
-    }), images.end());
-    Notify<&IDocumentsModelCallback::OnDocumentDeleted>(released.get());
+    deleteDocument(documents.begin() + index);
 }
 
 void CBasicDocumentModel::DeleteDocument(const IDocument* document)
@@ -129,12 +165,74 @@ void CBasicDocumentModel::DeleteDocument(const IDocument* document)
         }
     );
     if (findRes != documents.end()) {
-        std::unique_ptr<IDocument> released{findRes->release()};
-        released->Unsubscribe(this);
-        documents.erase(findRes);
-        images.erase(std::remove_if(images.begin(), images.end(), [&released](const auto& imagePtr) {
-            return imagePtr->GetDocument() == released.get();
-        }), images.end());
-        Notify<&IDocumentsModelCallback::OnDocumentDeleted>(released.get());
+        deleteDocument(findRes);
+    }
+}
+
+void CBasicDocumentModel::deleteDocument(std::vector<std::unique_ptr<IDocument>>::iterator document)
+{
+    std::unique_ptr<IDocument> released{document->release()};
+    released->Unsubscribe(this);
+    documents.erase(document);
+    size_t keptCount = 0;
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (images[i]->GetDocument() != released.get()) {
+            images[keptCount] = images[i];
+            headerTexts[keptCount] = headerTexts[i];
+            ++keptCount;
+        }
+    }
+    images.resize(keptCount);
+    headerTexts.resize(keptCount);
+
+    if (updateDepth > 0) {
+        auto& added = pendingChanges.addedDocuments;
+        auto addedRes = std::find(added.begin(), added.end(), released.get());
+        if (addedRes != added.end()) {
+            // Nobody has seen this document yet
+            added.erase(addedRes);
+            pendingChanges.insertedPagesCount -= released->GetPagesCount();
+            documentHeaders.erase(released.get());
+            return;
+        }
+        pendingChanges.deletedDocuments.push_back(released.get());
+    }
+
+    auto headers = documentHeaders.extract(released.get());
+    deletedDocuments.push_back(std::make_shared<CDeletedDocument>(CDeletedDocument{std::move(released), std::move(headers)}));
+    if (updateDepth == 0) {
+        Notify<&IDocumentsModelCallback::OnDocumentDeleted>(deletedDocuments.back()->document.get());
+        // The document is destroyed here unless the subscribers retained it
+        deletedDocuments.pop_back();
+    }
+}
+
+void CBasicDocumentModel::OnChanged(IDocument* document)
+{
+    TRACE()
+
+    Notify<&IDocumentsModelCallback::OnDocumentChanged>(document);
+}
+
+void CBasicDocumentModel::formatHeaders(const IDocument& document)
+{
+    auto documentName = ::PathFindFileNameW(document.GetName());
+    const int pagesCount = document.GetPagesCount();
+
+    // All headers of the document share one buffer, so a page costs no allocation of its own
+    auto& headers = documentHeaders[&document];
+    std::vector<size_t> offsets;
+    offsets.reserve(pagesCount + 1);
+    for (int i = 0; i < pagesCount; ++i) {
+        wchar_t pageTitleBuffer[4096] = {0};
+        const int length = wsprintf(pageTitleBuffer, L"%s %d of %d", documentName, i + 1, pagesCount);
+        offsets.push_back(headers.size());
+        headers.append(pageTitleBuffer, length);
+        headers.push_back(L'\0');
+    }
+    offsets.push_back(headers.size());
+
+    for (int i = 0; i < pagesCount; ++i) {
+        headerTexts.emplace_back(headers.data() + offsets[i], offsets[i + 1] - offsets[i] - 1);
     }
 }
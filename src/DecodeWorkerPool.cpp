@@ -0,0 +1,188 @@
+#include <DecodeWorkerPool.h>
+
+#include <Defines.h>
+
+#include <windows.h>
+
+#include <algorithm>
+
+CDecodeWorkerPool& CDecodeWorkerPool::Instance()
+{
+    static CDecodeWorkerPool pool;
+    return pool;
+}
+
+CDecodeWorkerPool::CDecodeWorkerPool()
+{
+    TRACE()
+
+    // One core is left to the UI and layout threads, hardware_concurrency is 0 if unknown
+    const size_t workersCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    runningOwners.resize(workersCount, nullptr);
+    workers.reserve(workersCount);
+    for (size_t i = 0; i < workersCount; ++i) {
+        workers.emplace_back([this, i] { this->runWorker(i); });
+    }
+}
+
+CDecodeWorkerPool::~CDecodeWorkerPool()
+{
+    TRACE()
+
+    {
+        std::lock_guard lock{mutex};
+        isStopping = true;
+        jobs.clear();
+    }
+    jobsChanged.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void CDecodeWorkerPool::Submit(const void* owner, CDecodeJob job)
+{
+    {
+        std::lock_guard lock{mutex};
+        jobs.emplace_back(owner, std::move(job));
+    }
+    jobsChanged.notify_all();
+}
+
+void CDecodeWorkerPool::Cancel(const void* owner)
+{
+    std::unique_lock lock{mutex};
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [owner](const auto& job) {
+        return job.first == owner;
+    }), jobs.end());
+    jobsChanged.wait(lock, [this, owner] {
+        return std::find(runningOwners.begin(), runningOwners.end(), owner) == runningOwners.end();
+    });
+    completions.erase(std::remove_if(completions.begin(), completions.end(), [owner](const auto& completion) {
+        return completion.first == owner;
+    }), completions.end());
+    if (dispatchDepth > 0) {
+        // Completions taken by DispatchCompleted are not in the list anymore
+        cancelledOwners.push_back(owner);
+    }
+}
+
+void CDecodeWorkerPool::Drop(const void* owner)
+{
+    std::lock_guard lock{mutex};
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [owner](const auto& job) {
+        return job.first == owner;
+    }), jobs.end());
+}
+
+void CDecodeWorkerPool::SetPriorities(const std::vector<const void*>& owners)
+{
+    std::lock_guard lock{mutex};
+    priorities.clear();
+    for (size_t i = 0; i < owners.size(); ++i) {
+        priorities.try_emplace(owners[i], i);
+    }
+}
+
+void CDecodeWorkerPool::DispatchCompleted()
+{
+    std::vector<std::pair<const void*, CCompletion>> ready;
+    {
+        std::lock_guard lock{mutex};
+        ready.swap(completions);
+        ++dispatchDepth;
+    }
+    for (auto& [owner, completion] : ready) {
+        // A completion may destroy pages, e.g. when it deletes a document, and they cancel their own completions
+        bool isCancelled = false;
+        {
+            std::lock_guard lock{mutex};
+            isCancelled = std::find(cancelledOwners.begin(), cancelledOwners.end(), owner) != cancelledOwners.end();
+        }
+        if (!isCancelled) {
+            completion();
+        }
+    }
+
+    std::lock_guard lock{mutex};
+    if (--dispatchDepth == 0) {
+        cancelledOwners.clear();
+    }
+}
+
+void CDecodeWorkerPool::AddCompletionListener(IDecodeCompletionListener* listener)
+{
+    std::lock_guard lock{mutex};
+    completionListeners.Subscribe(listener);
+    // Completions that were ready before are not lost
+    if (!completions.empty()) {
+        listener->OnCompletionsReady();
+    }
+}
+
+void CDecodeWorkerPool::RemoveCompletionListener(IDecodeCompletionListener* listener)
+{
+    // Listeners are notified under the lock, so none is running after it is taken
+    std::lock_guard lock{mutex};
+    completionListeners.Unsubscribe(listener);
+}
+
+size_t CDecodeWorkerPool::rankOf(const void* owner) const
+{
+    auto iter = priorities.find(owner);
+    return iter != priorities.end() ? iter->second : priorities.size();
+}
+
+std::deque<std::pair<const void*, CDecodeWorkerPool::CDecodeJob>>::iterator CDecodeWorkerPool::nextJob()
+{
+    // Only a few screens of pages are queued, so looking through all of them is cheap
+    auto next = jobs.end();
+    for (auto iter = jobs.begin(); iter != jobs.end(); ++iter) {
+        // Jobs of one owner share its decoder, so they never run at the same time
+        if (std::find(runningOwners.begin(), runningOwners.end(), iter->first) != runningOwners.end()) {
+            continue;
+        }
+        if (next == jobs.end() || rankOf(iter->first) < rankOf(next->first)) {
+            next = iter;
+        }
+    }
+    return next;
+}
+
+void CDecodeWorkerPool::runWorker(size_t workerIndex)
+{
+    // WIC objects are used from worker threads
+    OK(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+
+    std::unique_lock lock{mutex};
+    while (true) {
+        auto next = jobs.end();
+        jobsChanged.wait(lock, [this, &next] {
+            next = nextJob();
+            return isStopping || next != jobs.end();
+        });
+        if (isStopping) {
+            break;
+        }
+        auto [owner, job] = std::move(*next);
+        jobs.erase(next);
+        runningOwners[workerIndex] = owner;
+
+        lock.unlock();
+        auto completion = job();
+        lock.lock();
+
+        runningOwners[workerIndex] = nullptr;
+        if (completion) {
+            completions.emplace_back(owner, std::move(completion));
+            // Listeners are notified once per batch of completions
+            if (completions.size() == 1) {
+                completionListeners.Notify<&IDecodeCompletionListener::OnCompletionsReady>();
+            }
+        }
+        jobsChanged.notify_all();
+    }
+    lock.unlock();
+
+    CoUninitialize();
+}
@@ -1,77 +1,301 @@
 #include <DocumentFromDisk.h>
 
+#include "PixelConversion.h"
+
 #include <Defines.h>
 #include <ComPtr.h>
+#include <DecodeWorkerPool.h>
+#include <ImagingService.h>
 
 #include <d2d1_1.h>
 #include <dwrite.h>
 #include <wincodec.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <list>
+#include <mutex>
+#include <utility>
+
+/// @brief Size and resolution of a frame
+struct CFrameHeader
+{
+    /// Pages whose frames failed to open are drawn as an empty square
+    SIZE size{200, 200};
+    D2D1_POINT_2F dpi{96.f, 96.f};
+    bool isRead = false;
+};
+
+/// @brief Opens frames of a decoder and keeps a few recently used ones open.
+/// Headers of all frames are read once when the document is opened, pages open their frame every time they decode it on a worker thread.
+class CFrameCache
+{
+public:
+    explicit CFrameCache(CComPtr<IWICBitmapDecoder> decoder) : decoder{std::move(decoder)} {}
+
+    /// @brief Lock the decoder. Frames read the decoder's stream, so pages of a document
+    /// open and decode them one at a time, pages of different documents are decoded in parallel.
+    std::unique_lock<std::mutex> Lock() { return std::unique_lock{mutex}; }
+
+    /// @brief Open a frame, the decoder must be locked
+    /// @param index Frame index
+    /// @return Frame or nullptr if it can't be opened
+    CComPtr<IWICBitmapFrameDecode> Open(UINT index);
+
+    /// @brief Read sizes and resolutions of all frames. No pixels are decoded, so it is cheap compared to decoding.
+    /// @param framesCount Number of frames of the decoder
+    void ReadHeaders(UINT framesCount);
+    const CFrameHeader& GetHeader(UINT index) const { return headers.at(index); }
+
+private:
+    /// Multi-page files are scrolled through sequentially, so a few frames around the viewport are enough
+    static constexpr size_t Capacity = 8;
+
+    std::mutex mutex;
+    CComPtr<IWICBitmapDecoder> decoder;
+    /// Most recently used frames first
+    std::list<std::pair<UINT, CComPtr<IWICBitmapFrameDecode>>> recentFrames;
+    std::vector<CFrameHeader> headers;
+};
+
+/// @brief Read-only view of a whole file
+class CMappedFile
+{
+public:
+    /// @brief Map the file, IsMapped tells if it worked
+    explicit CMappedFile(const wchar_t* fileName);
+    ~CMappedFile();
+
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile& operator=(const CMappedFile&) = delete;
+
+    bool IsMapped() const { return data != nullptr; }
+    BYTE* GetData() const { return data; }
+    DWORD GetSize() const { return size; }
+
+private:
+    /// Larger files are read through a WIC file stream, views of them would eat the address space
+    static constexpr LONGLONG MaxMappedSize = LONGLONG(1) << 30;
+
+    BYTE* data = nullptr;
+    DWORD size = 0;
+};
 
 class CWICImage : public IPage
 {
 public:
-    CWICImage(IWICImagingFactory* factory, IDocument* parent, IWICBitmapFrameDecode* frame);
+    CWICImage(IWICImagingFactory* factory, IDocument* parent, CFrameCache* frames, UINT frameIndex);
     ~CWICImage() override;
 
     const IDocument* GetDocument() const override { return parent; }
     TPageState GetPageState() const override;
     SIZE GetPageSize() const override;
     ID2D1Bitmap* GetPageBitmap() const override;
-    void PrepareBitmapForTarget(ID2D1RenderTarget* renderTarget) override;
+    void PrepareBitmapForTarget(ID2D1RenderTarget* renderTarget, float scale) override;
+    void ReleaseBitmap() override;
 
 private:
+    /// Levels of detail don't go below this many pixels per side
+    static constexpr LONG MinLevelSide = 16;
+
+    IWICImagingFactory* factory;
     IDocument* parent;
+    CFrameCache* frames;
+    UINT frameIndex;
+    /// The frame header was read when the document was opened, so the page can be decoded
+    bool isProbed = false;
     bool isFailedToLoad = false;
-    CComPtr<IWICBitmapSource> imageSource;
+    /// Pixels are being decoded by the worker pool
+    bool isDecoding = false;
+    /// Incremented when decoding is dropped, so the result of a dropped job is ignored
+    unsigned decodeGeneration = 0;
+    /// Read from the frame header when the document was opened, decoding never changes it
+    SIZE size{200, 200};
+    /// Resolution of the frame, bitmaps are created with it so their DIP size doesn't depend on the level of detail
+    D2D1_POINT_2F dpi{96.f, 96.f};
     CComPtr<ID2D1Bitmap> bitmap;
+    /// Level of detail of the bitmap, level N is 2^N times smaller than the page
+    unsigned bitmapLevel = 0;
+    /// Level of detail being decoded
+    unsigned decodingLevel = 0;
+    /// Target the decoded pixels are uploaded to
+    ID2D1RenderTarget* target = nullptr;
+
+    /// @brief Smallest level of detail that is not smaller than the page drawn with the scale
+    unsigned levelFor(float scale) const;
+    SIZE levelSize(unsigned level) const;
+    /// @brief Check if the embedded thumbnail can be scaled to the level instead of the full image
+    bool isThumbnailFor(SIZE thumbnailSize, SIZE pixelsSize) const;
+    /// @brief Decode the frame to PBGRA pixels of the given size. Runs on a worker thread,
+    /// so it only uses the members that don't change after construction.
+    HRESULT decodePixels(SIZE pixelsSize, std::vector<BYTE>& pixels) const;
+    void onDecoded(unsigned generation, unsigned level, HRESULT decodeResult, std::vector<BYTE> pixels);
 };
 
 const IPage* CDocumentFromDisk::GetPage(int index) const
 {
-    return images.at(index).get();
+    auto& image = images.at(index);
+    if (image == nullptr) {
+        // Pages are created when they are asked for, they take their sizes from the headers read on open
+        auto self = const_cast<CDocumentFromDisk*>(this);
+        image = std::make_unique<CWICImage>(CImagingService::Instance().GetWICFactory(), self, frames.get(), UINT(index));
+        image->Subscribe(self);
+    }
+    return image.get();
 }
 
-static auto CreateWICFactory()
+CMappedFile::CMappedFile(const wchar_t* fileName)
 {
-    CComPtr<IWICImagingFactory> wicFactory = nullptr;
-    OK(CoCreateInstance(
-            CLSID_WICImagingFactory,
-            NULL,
-            CLSCTX_INPROC_SERVER,
-            IID_PPV_ARGS(&wicFactory.ptr)
-        )
-    );
+    TRACE()
 
-    return wicFactory;
+    HANDLE file = CreateFileW(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    LARGE_INTEGER fileSize{};
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && fileSize.QuadPart <= MaxMappedSize) {
+        HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            // The view keeps the mapping and the file open, so their handles aren't needed anymore
+            data = static_cast<BYTE*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            size = data != nullptr ? DWORD(fileSize.QuadPart) : 0;
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
 }
 
-CWICImage::CWICImage(IWICImagingFactory* factory, IDocument* _parent, IWICBitmapFrameDecode* frame) :
-    parent{_parent}
+CMappedFile::~CMappedFile()
+{
+    TRACE()
+
+    if (data != nullptr) {
+        UnmapViewOfFile(data);
+    }
+}
+
+/// @brief Check if the format is converted to PBGRA by our kernels rather than by IWICFormatConverter
+static bool IsConvertedByKernel(REFWICPixelFormatGUID format)
+{
+    return format == GUID_WICPixelFormat24bppBGR
+        || format == GUID_WICPixelFormat32bppBGR
+        || format == GUID_WICPixelFormat32bppBGRA;
+}
+
+/// @brief Copy pixels of a source in a format accepted by IsConvertedByKernel as PBGRA
+static HRESULT CopyPixelsAsPbgra(IWICBitmapSource* source, REFWICPixelFormatGUID format, UINT width, UINT height, BYTE* pixels)
+{
+    // Rows are converted in batches right after they are decoded, while they are still in cache
+    constexpr UINT batchBytes = 256 << 10;
+    const bool isBgr = format == GUID_WICPixelFormat24bppBGR;
+    const UINT stride = width * 4;
+    const UINT sourceStride = isBgr ? width * 3 : stride;
+    const UINT batchRows = std::max(batchBytes / sourceStride, 1u);
+    std::vector<BYTE> bgrRows(isBgr ? size_t(sourceStride) * std::min(batchRows, height) : 0);
+
+    for (UINT top = 0; top < height; top += batchRows) {
+        const UINT rows = std::min(batchRows, height - top);
+        const WICRect rect{0, INT(top), INT(width), INT(rows)};
+        BYTE* batch = pixels + size_t(stride) * top;
+        // Strides have no padding, so the rows of a batch are one run of pixels
+        const size_t pixelsCount = size_t(width) * rows;
+        if (isBgr) {
+            const HRESULT result = source->CopyPixels(&rect, sourceStride, sourceStride * rows, bgrRows.data());
+            if (result != S_OK) {
+                return result;
+            }
+            ConvertBgrToPbgra(bgrRows.data(), batch, pixelsCount);
+            continue;
+        }
+        const HRESULT result = source->CopyPixels(&rect, stride, stride * rows, batch);
+        if (result != S_OK) {
+            return result;
+        }
+        if (format == GUID_WICPixelFormat32bppBGRA) {
+            PremultiplyBgra(batch, pixelsCount);
+        } else {
+            FillOpaqueAlpha(batch, pixelsCount);
+        }
+    }
+    return S_OK;
+}
+
+CComPtr<IWICBitmapFrameDecode> CFrameCache::Open(UINT index)
+{
+    auto iter = std::find_if(recentFrames.begin(), recentFrames.end(), [index](const auto& frame) {
+        return frame.first == index;
+    });
+    if (iter != recentFrames.end()) {
+        recentFrames.splice(recentFrames.begin(), recentFrames, iter);
+        return recentFrames.front().second;
+    }
+
+    CComPtr<IWICBitmapFrameDecode> frame = nullptr;
+    if (decoder->GetFrame(index, &frame.ptr) != S_OK) {
+        return nullptr;
+    }
+    if (recentFrames.size() >= Capacity) {
+        recentFrames.pop_back();
+    }
+    recentFrames.emplace_front(index, std::move(frame));
+    return recentFrames.front().second;
+}
+
+void CFrameCache::ReadHeaders(UINT framesCount)
+{
+    std::lock_guard lock{mutex};
+    headers.assign(framesCount, CFrameHeader{});
+    for (UINT i = 0; i < framesCount; ++i) {
+        // Frames are not cached here, so reading the headers of a long file doesn't evict anything
+        CComPtr<IWICBitmapFrameDecode> frame = nullptr;
+        UINT width = 0;
+        UINT height = 0;
+        if (decoder->GetFrame(i, &frame.ptr) != S_OK || frame->GetSize(&width, &height) != S_OK || width == 0 || height == 0) {
+            continue;
+        }
+        auto& header = headers[i];
+        header.size = {(LONG)width, (LONG)height};
+        double frameDpiX = 0.0;
+        double frameDpiY = 0.0;
+        // Some formats store no resolution or a zero one
+        if (frame->GetResolution(&frameDpiX, &frameDpiY) == S_OK && frameDpiX > 0.0 && frameDpiY > 0.0) {
+            header.dpi = {float(frameDpiX), float(frameDpiY)};
+        }
+        header.isRead = true;
+    }
+}
+
+CWICImage::CWICImage(IWICImagingFactory* _factory, IDocument* _parent, CFrameCache* _frames, UINT _frameIndex) :
+    factory{_factory},
+    parent{_parent},
+    frames{_frames},
+    frameIndex{_frameIndex}
 {
     TRACE()
 
     NOTNULL(parent);
-    NOTNULL(frame);
-
-    IWICFormatConverter* converter = NULL;
-    OK(factory->CreateFormatConverter(&converter));
-    OK(converter->Initialize(
-            frame,
-            GUID_WICPixelFormat32bppPBGRA,
-            WICBitmapDitherTypeNone,
-            NULL,
-            0.f,
-            WICBitmapPaletteTypeMedianCut
-        )
-    );
-    imageSource = converter;
+    NOTNULL(frames);
+
+    // Size and resolution come from the frame header, so the layout is final before any pixel is decoded
+    const auto& header = frames->GetHeader(frameIndex);
+    if (!header.isRead) {
+        std::wcerr << parent->GetName() << " - failed to read a page size\n";
+        isFailedToLoad = true;
+        return;
+    }
+    size = header.size;
+    dpi = header.dpi;
+    isProbed = true;
 }
 
 CWICImage::~CWICImage()
 {
     TRACE()
+
+    // The decode job and its completion refer to this page
+    CDecodeWorkerPool::Instance().Cancel(static_cast<IPage*>(this));
 }
 
 TPageState CWICImage::GetPageState() const
@@ -92,11 +316,8 @@ SIZE CWICImage::GetPageSize() const
 {
     TRACE()
 
-    if (bitmap.ptr != nullptr) {
-        auto size = const_cast<ID2D1Bitmap*>(bitmap.ptr)->GetSize(); 
-        return {(LONG)size.width, (LONG)size.height};
-    }
-    return {200, 200};
+    // Known since construction, decoding never changes it
+    return size;
 }
 
 ID2D1Bitmap* CWICImage::GetPageBitmap() const
@@ -104,30 +325,218 @@ ID2D1Bitmap* CWICImage::GetPageBitmap() const
     return bitmap.ptr;
 }
 
-void CWICImage::PrepareBitmapForTarget(ID2D1RenderTarget* target)
+void CWICImage::PrepareBitmapForTarget(ID2D1RenderTarget* renderTarget, float scale)
 {
     TRACE()
-    if (imageSource == nullptr) {
+    if (!isProbed) {
         return;
     }
-    NOTNULL(target);
-    if (bitmap != nullptr) {
+    NOTNULL(renderTarget);
+    if (renderTarget == target && isFailedToLoad) {
+        return;
+    }
+    if (renderTarget != target) {
+        // Pixels being decoded will be uploaded to the new target
+        bitmap.Reset();
+        target = renderTarget;
+    }
+
+    // A level finer by one is good enough, so zooming around a level boundary doesn't decode the page again
+    const unsigned level = levelFor(scale);
+    const bool hasLevel = isDecoding || bitmap != nullptr;
+    const unsigned currentLevel = isDecoding ? decodingLevel : bitmapLevel;
+    if (hasLevel && currentLevel <= level && level - currentLevel <= 1) {
+        return;
+    }
+
+    if (isDecoding) {
+        // The level being decoded is not the wanted one anymore
+        CDecodeWorkerPool::Instance().Drop(static_cast<IPage*>(this));
+        ++decodeGeneration;
+    } else if (bitmap == nullptr) {
+        Notify<&IPageCallback::OnLoadingStarted>();
+    }
+    // The current bitmap, if any, is drawn until the new level is ready
+    isDecoding = true;
+    isFailedToLoad = false;
+    decodingLevel = level;
+
+    // Decoding is the slow part, so it runs on a worker and only the upload is left to the UI thread
+    CDecodeWorkerPool::Instance().Submit(static_cast<IPage*>(this),
+        [this, generation = decodeGeneration, level, pixelsSize = levelSize(level)] {
+            const auto decodeStart = std::chrono::steady_clock::now();
+            std::vector<BYTE> pixels;
+            const HRESULT decodeResult = this->decodePixels(pixelsSize, pixels);
+            CImagingService::Instance().RecordDecode(std::chrono::steady_clock::now() - decodeStart);
+            return [this, generation, level, decodeResult, pixels = std::move(pixels)]() mutable {
+                this->onDecoded(generation, level, decodeResult, std::move(pixels));
+            };
+        });
+}
+
+void CWICImage::ReleaseBitmap()
+{
+    TRACE()
+
+    bitmap.Reset();
+    if (isDecoding) {
+        // A job that is already running can't be stopped, its result is ignored
+        CDecodeWorkerPool::Instance().Drop(static_cast<IPage*>(this));
+        isDecoding = false;
+        ++decodeGeneration;
+    }
+}
+
+unsigned CWICImage::levelFor(float scale) const
+{
+    unsigned level = 0;
+    while (scale * float(2u << level) <= 1.f) {
+        const SIZE nextSize = levelSize(level + 1);
+        if (nextSize.cx < MinLevelSide || nextSize.cy < MinLevelSide) {
+            break;
+        }
+        ++level;
+    }
+    return level;
+}
+
+SIZE CWICImage::levelSize(unsigned level) const
+{
+    const LONG divisor = LONG(1) << level;
+    return {std::max((size.cx + divisor - 1) / divisor, 1L), std::max((size.cy + divisor - 1) / divisor, 1L)};
+}
+
+bool CWICImage::isThumbnailFor(SIZE thumbnailSize, SIZE pixelsSize) const
+{
+    if (thumbnailSize.cx < pixelsSize.cx || thumbnailSize.cy < pixelsSize.cy) {
+        return false;
+    }
+    // Some encoders letterbox thumbnails, those would distort the page
+    const LONGLONG aspectDifference = std::abs(LONGLONG(thumbnailSize.cx) * size.cy - LONGLONG(thumbnailSize.cy) * size.cx);
+    return aspectDifference * 50 <= LONGLONG(thumbnailSize.cx) * size.cy;
+}
+
+HRESULT CWICImage::decodePixels(SIZE pixelsSize, std::vector<BYTE>& pixels) const
+{
+    // Converters and scalers read the frame while pixels are copied, so the decoder stays locked till the end
+    auto lock = frames->Lock();
+    auto frame = frames->Open(frameIndex);
+    if (frame.ptr == nullptr) {
+        return E_FAIL;
+    }
+
+    // JPEG and TIFF files often carry a small preview, it is read from the metadata without decoding the image
+    IWICBitmapSource* source = frame.ptr;
+    CComPtr<IWICBitmapSource> thumbnail = nullptr;
+    UINT width = 0;
+    UINT height = 0;
+    if (pixelsSize.cx < size.cx
+        && frame->GetThumbnail(&thumbnail.ptr) == S_OK
+        && thumbnail->GetSize(&width, &height) == S_OK
+        && isThumbnailFor({LONG(width), LONG(height)}, pixelsSize))
+    {
+        source = thumbnail.ptr;
+    }
+
+    WICPixelFormatGUID format{};
+    HRESULT result = source->GetPixelFormat(&format);
+    if (result == S_OK) {
+        result = source->GetSize(&width, &height);
+    }
+    const bool isScaled = LONG(width) != pixelsSize.cx || LONG(height) != pixelsSize.cy;
+    if (result == S_OK && !isScaled && IsConvertedByKernel(format)) {
+        pixels.resize(size_t(width) * height * 4);
+        return CopyPixelsAsPbgra(source, format, width, height, pixels.data());
+    }
+
+    // Premultiplied BGRA is what bitmaps are created from, so it needs no conversion
+    IWICBitmapSource* pixelsSource = source;
+    CComPtr<IWICFormatConverter> converter = nullptr;
+    if (result == S_OK && format != GUID_WICPixelFormat32bppPBGRA) {
+        result = factory->CreateFormatConverter(&converter.ptr);
+        if (result == S_OK) {
+            result = converter->Initialize(
+                source,
+                GUID_WICPixelFormat32bppPBGRA,
+                WICBitmapDitherTypeNone,
+                NULL,
+                0.f,
+                WICBitmapPaletteTypeMedianCut
+            );
+            pixelsSource = converter.ptr;
+        }
+    }
+
+    // Levels of detail are scaled after the conversion, so colors are averaged premultiplied
+    CComPtr<IWICBitmapScaler> scaler = nullptr;
+    if (result == S_OK && isScaled) {
+        // Fant averages all the covered source pixels, so small levels don't alias
+        result = factory->CreateBitmapScaler(&scaler.ptr);
+        if (result == S_OK) {
+            result = scaler->Initialize(pixelsSource, pixelsSize.cx, pixelsSize.cy, WICBitmapInterpolationModeFant);
+            pixelsSource = scaler.ptr;
+        }
+    }
+
+    if (result == S_OK) {
+        const UINT stride = pixelsSize.cx * 4;
+        pixels.resize(size_t(stride) * pixelsSize.cy);
+        result = pixelsSource->CopyPixels(nullptr, stride, pixels.size(), pixels.data());
+    }
+    return result;
+}
+
+void CWICImage::onDecoded(unsigned generation, unsigned level, HRESULT decodeResult, std::vector<BYTE> pixels)
+{
+    TRACE()
+
+    if (generation != decodeGeneration) {
+        return;
+    }
+    isDecoding = false;
+    if (decodeResult != S_OK) {
+        std::wcerr << parent->GetName() << " - failed to decode a page\n";
         bitmap.Reset();
+        isFailedToLoad = true;
+    } else {
+        const SIZE pixelsSize = levelSize(level);
+        const auto bitmapProperties = D2D1::BitmapProperties(
+            D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED),
+            dpi.x * pixelsSize.cx / size.cx,
+            dpi.y * pixelsSize.cy / size.cy);
+        CComPtr<ID2D1Bitmap> levelBitmap = nullptr;
+        isFailedToLoad = target->CreateBitmap(
+            D2D1::SizeU(pixelsSize.cx, pixelsSize.cy), pixels.data(), pixelsSize.cx * 4, &bitmapProperties, &levelBitmap.ptr) != S_OK;
+        bitmap = std::move(levelBitmap);
+        bitmapLevel = level;
     }
-    OK(target->CreateBitmapFromWicBitmap(imageSource, nullptr, &bitmap.ptr));
+    Notify<&IPageCallback::OnLoadingFinished>();
 }
 
 CDocumentFromDisk::CDocumentFromDisk(const wchar_t* _fileName) :
-    fileName{_fileName},
-    wicFactory{CreateWICFactory()}
+    fileName{_fileName}
 {
     TRACE()
+    const auto openStart = std::chrono::steady_clock::now();
+    auto factory = CImagingService::Instance().GetWICFactory();
     CComPtr<IWICBitmapDecoder> imageDecoder = nullptr;
-    if(wicFactory->CreateDecoderFromFilename(
+
+    // Decoders read a mapped file right from the page cache, repeated opens of a file don't touch the disk
+    auto mapped = std::make_unique<CMappedFile>(fileName.c_str());
+    CComPtr<IWICStream> stream = nullptr;
+    if (mapped->IsMapped()
+        && factory->CreateStream(&stream.ptr) == S_OK
+        && stream->InitializeFromMemory(mapped->GetData(), mapped->GetSize()) == S_OK
+        // Pages only need frame headers to be laid out, the rest of the metadata is read if it is asked for
+        && factory->CreateDecoderFromStream(stream, NULL, WICDecodeMetadataCacheOnDemand, &imageDecoder.ptr) == S_OK)
+    {
+        mappedFile = std::move(mapped);
+    }
+    else if(factory->CreateDecoderFromFilename(
                 fileName.c_str(),
                 NULL,
                 GENERIC_READ,
-                WICDecodeMetadataCacheOnLoad,
+                WICDecodeMetadataCacheOnDemand,
                 &imageDecoder.ptr) != S_OK)
     {
         std::wcerr << fileName.c_str() << " - format not supported\n";
@@ -136,14 +545,11 @@ CDocumentFromDisk::CDocumentFromDisk(const wchar_t* _fileName) :
 
     UINT framesCount = 0;
     OK(imageDecoder->GetFrameCount(&framesCount));
-    for (UINT i = 0; i < framesCount; ++i) {
-        CComPtr<IWICBitmapFrameDecode> imageSource = nullptr;
-        assert(imageDecoder->GetFrame(i, &imageSource.ptr) == S_OK);
-
-        auto page = std::make_unique<CWICImage>(wicFactory, this, imageSource.ptr);
-        page->Subscribe(this);
-        images.push_back(std::move(page));
-    }
+    frames = std::make_unique<CFrameCache>(std::move(imageDecoder));
+    // Headers are read before the document is added to a model, so the pages are laid out with their final sizes
+    frames->ReadHeaders(framesCount);
+    images.resize(framesCount);
+    CImagingService::Instance().RecordOpen(std::chrono::steady_clock::now() - openStart);
 }
 
 CDocumentFromDisk::~CDocumentFromDisk()
@@ -151,6 +557,13 @@ CDocumentFromDisk::~CDocumentFromDisk()
     TRACE()
 }
 
+void CDocumentFromDisk::OnLoadingFinished()
+{
+    TRACE()
+
+    Notify<&IDocumentCallback::OnChanged>(this);
+}
+
 int CDocumentFromDisk::GetIndexOf(const IPage* page) const
 {
     TRACE()
@@ -29,6 +29,9 @@ namespace {
 
 const wchar_t* DocumentViewClassName = L"DIRECT2DDOCUMENTVIEW";
 
+/// Posted by the decode worker pool when decoded pages are ready to be uploaded
+const UINT WM_DECODE_COMPLETED = WM_APP + 1;
+
 LRESULT WINAPI DocumentViewProc(HWND window, UINT msg, WPARAM wParam, LPARAM lParam)
 {
     CDocumentView* documentView = nullptr;
@@ -81,7 +84,8 @@ void RegisterDocumentViewClass()
 
 }
 
-CDocumentView::CDocumentView(HWND parent)
+CDocumentView::CDocumentView(HWND parent) :
+    decodeScheduler{std::make_unique<DocumentViewPrivate::CDecodeScheduler>()}
 {
     RegisterDocumentViewClass();
     if (CreateWindowEx(0, // EX STYLES
@@ -100,7 +104,7 @@ CDocumentView::CDocumentView(HWND parent)
     {
         throw std::runtime_error("CDocumentView::CDocumentView; CreateWindowEx");
     }
-    helper.reset(new DocumentViewPrivate::CDocumentLayoutHelper{});
+    helper.reset(new DocumentViewPrivate::CDocumentLayoutHelper{[this] { this->onLayoutPublished(); }});
 }
 
 CDocumentView::~CDocumentView() = default;
@@ -112,7 +116,10 @@ void CDocumentView::AttachHandle(HWND _window)
     this->d2dFactory.Reset();
 
     OK(D2D1CreateFactory(D2D1_FACTORY_TYPE_SINGLE_THREADED, &d2dFactory.ptr));
-    helper.reset( new DocumentViewPrivate::CDocumentLayoutHelper{} );
+    helper.reset( new DocumentViewPrivate::CDocumentLayoutHelper{[this] { this->onLayoutPublished(); }} );
+
+    // Decoded pixels are uploaded on this thread, so the pool only asks for it
+    CDecodeWorkerPool::Instance().AddCompletionListener(this);
 }
 
 void CDocumentView::Show()
@@ -133,8 +140,9 @@ void CDocumentView::SetModel(IDocumentsModel* _model)
         this->model->Unsubscribe(this);
     }
     this->selectionModel.SetModel(_model);
+    this->decodeScheduler->Clear();
+    this->clearPages();
     this->model.reset(_model);
-    this->helper->ClearPages();
     if (this->model == nullptr) {
         return;
     }
@@ -145,13 +153,7 @@ void CDocumentView::SetModel(IDocumentsModel* _model)
         this->model->CreateImages(this->surfaceContext.deviceContext);
     }
 
-    for (int i = 0; i < this->model->GetTotalPageCount(); ++i)
-    {
-        auto page = reinterpret_cast<IPage*>(model->GetData(i, TDocumentModelRoles::PageRole));
-        auto format = reinterpret_cast<IDWriteTextFormat*>(model->GetData(i, TDocumentModelRoles::HeaderFontRole));
-        std::unique_ptr<wchar_t> headerText{(wchar_t*)model->GetData(i, TDocumentModelRoles::HeaderTextRole)};
-        this->helper->AddPage(page, format, std::wstring{headerText.get()});
-    }
+    this->helper->InsertPages(*this->model, 0, this->model->GetTotalPageCount());
 }
 
 IDocumentsModel* CDocumentView::GetModel() const
@@ -171,7 +173,8 @@ bool CDocumentView::HandleMessage(UINT msg, WPARAM wParam, LPARAM lParam)
         {WM_SIZE, &CDocumentView::OnSize},
         {WM_MOUSEWHEEL, &CDocumentView::OnScroll},
         {WM_LBUTTONUP, &CDocumentView::OnLButtonUp},
-        {WM_DESTROY, &CDocumentView::OnDestroy}
+        {WM_DESTROY, &CDocumentView::OnDestroy},
+        {WM_DECODE_COMPLETED, &CDocumentView::OnDecodeCompleted}
     };
 
     auto findRes = messageHandlers.find(msg);
@@ -194,9 +197,24 @@ void CDocumentView::SetAlignment(TImagesViewAlignment alignment)
     this->Redraw();
 }
 
+bool CDocumentView::IsLayoutCurrent() const
+{
+    return this->helper->IsLayoutCurrent();
+}
+
+void CDocumentView::SetBitmapBudget(size_t bytes)
+{
+    this->decodeScheduler->GetResidency().SetBudget(bytes);
+    this->Redraw();
+}
+
+CBitmapResidencyCounters CDocumentView::GetBitmapResidencyCounters() const
+{
+    return this->decodeScheduler->GetResidency().GetCounters();
+}
+
 void CDocumentView::OnDraw(WPARAM, LPARAM)
 {
-    std::cout << "Redraw occured: " << GetTickCount64() << "\n";
     PAINTSTRUCT ps;
     BeginPaint(this->window, &ps);
 
@@ -220,50 +238,63 @@ void CDocumentView::OnDraw(WPARAM, LPARAM)
     renderTarget->BeginDraw();
     renderTarget->Clear(this->viewProperties.bkColor);
 
+    // Paint the latest finished layout, the one still being computed is painted when it is published.
+    // It is acquired without a model too, so the pages of the previous one are released.
+    this->helper->AcquireLayout();
     if (this->model != nullptr)
     {
         const auto& surfaceLayout = this->helper->GetLayout();
+        const auto viewportOffset = this->helper->GetViewportOffset();
         {
             CDirect2DMatrixSwitcher switcher{
                 this->surfaceContext.deviceContext,
-                D2D1::Matrix3x2F::Scale(this->helper->GetZoom(), this->helper->GetZoom())
-                    * D2D1::Matrix3x2F::Translation(surfaceLayout.viewportOffset.width, surfaceLayout.viewportOffset.height)};
+                D2D1::Matrix3x2F::Translation(surfaceLayout.columnOffset, 0.f)
+                    * D2D1::Matrix3x2F::Scale(this->helper->GetZoom(), this->helper->GetZoom())
+                    * D2D1::Matrix3x2F::Translation(viewportOffset.width, viewportOffset.height)};
 
             // ID2D1RectangleGeometry returns E_NOTIMPL in wine, so let's do plain old interseciton check
             auto intersects = [](const D2D1_RECT_F& r1, const D2D1_RECT_F& r2) {
                 return !(r2.left > r1.right || r2.right < r1.left || r2.top > r1.bottom || r2.bottom < r1.top);
             };
 
-            // Non-translated viewport rect with positive coordinates
-            D2D1_RECT_F viewPortRect{
-                surfaceLayout.viewportOffset.width / this->helper->GetZoom(),
-                -surfaceLayout.viewportOffset.height / this->helper->GetZoom(),
-                sizeF.width / this->helper->GetZoom(),
-                (-surfaceLayout.viewportOffset.height + sizeF.height) / this->helper->GetZoom()
-            };
+            // Viewport rect in the coordinates of page rects
+            const D2D1_RECT_F viewPortRect = this->helper->GetViewportRect();
+
+            // Visible pages get their bitmaps first, the ones being loaded are drawn when they are ready
+            this->decodeScheduler->Schedule(*this->helper, renderTarget);
 
-            for (auto& pageLayout : surfaceLayout.pageRects) {
-                if (intersects(viewPortRect, pageLayout.textRect)) {
+            auto [firstVisible, lastVisible] = this->helper->QueryVisible(viewPortRect);
+            this->helper->ReserveHeaderLayouts(lastVisible - firstVisible);
+            DocumentViewPrivate::CVisibilityMask textVisibility;
+            DocumentViewPrivate::CVisibilityMask pageVisibility;
+            DocumentViewPrivate::CullRects(surfaceLayout.textRects, firstVisible, lastVisible, viewPortRect, textVisibility);
+            DocumentViewPrivate::CullRects(surfaceLayout.pageRects, firstVisible, lastVisible, viewPortRect, pageVisibility);
+
+            for (auto i = firstVisible; i < lastVisible; ++i) {
+                if (textVisibility.IsVisible(i - firstVisible)) {
                     renderTarget->DrawTextLayout(
-                        {pageLayout.textRect.left, pageLayout.textRect.top},
-                        pageLayout.textLayout.ptr,
+                        {surfaceLayout.textRects.left[i], surfaceLayout.textRects.top[i]},
+                        this->helper->GetHeaderLayout(i),
                         surfaceContext.pageFrameBrush
                     );
                 }
 
-                if (intersects(viewPortRect, pageLayout.pageRect)) {
-                    if(pageLayout.page->GetPageState() == TPageState::READY) {
+                if (pageVisibility.IsVisible(i - firstVisible)) {
+                    const auto page = surfaceLayout.pages[i];
+                    const auto pageRect = surfaceLayout.pageRects[i];
+                    if(page->GetPageState() == TPageState::READY) {
                         renderTarget->DrawBitmap(
-                            pageLayout.page->GetPageBitmap(),
-                            pageLayout.pageRect,
+                            page->GetPageBitmap(),
+                            pageRect,
                             1.f,
-                            D2D1_INTERPOLATION_MODE_NEAREST_NEIGHBOR,
+                            // Bitmaps are close to the drawn size thanks to levels of detail, so filtering is cheap
+                            D2D1_INTERPOLATION_MODE_LINEAR,
                             nullptr
                         );
                     }
 
                     renderTarget->DrawRectangle(
-                        pageLayout.pageRect,
+                        pageRect,
                         this->surfaceContext.pageFrameBrush,
                         1.f / this->helper->GetZoom(),
                         nullptr
@@ -272,7 +303,10 @@ void CDocumentView::OnDraw(WPARAM, LPARAM)
             }
             if (this->selectionModel.HasSelection()) {
                 for (auto index : selectionModel.GetSelectedPages()) {
-                    auto& pageRect = surfaceLayout.pageRects.at(index).pageRect;
+                    if ((size_t)index >= surfaceLayout.GetPagesCount()) {
+                        continue;
+                    }
+                    const auto pageRect = surfaceLayout.pageRects[index];
                     if (intersects(viewPortRect, pageRect)) {
                         renderTarget->DrawRectangle(
                             pageRect,
@@ -358,60 +392,42 @@ void CDocumentView::OnLButtonUp(WPARAM wParam, LPARAM lParam)
         }
     }();
     (void)wParam; // Ignore key for now
-    int xClient = LOWORD(lParam) / this->helper->GetZoom();
-    int yClient = HIWORD(lParam) / this->helper->GetZoom();
 
     if (model != nullptr && surfaceContext.deviceContext != nullptr) {
-        auto sizeF = surfaceContext.deviceContext->GetSize();
-        const auto& surfaceLayout = this->helper->GetLayout();
-
-        xClient -= surfaceLayout.totalSurfaceSize.width * this->helper->GetHScroll();
-        yClient -= surfaceLayout.totalSurfaceSize.height * this->helper->GetVScroll();
-
-        auto isPtInRect = [xClient, yClient](const D2D1_RECT_F& rect) {
-            return rect.left <= xClient && rect.right >= xClient
-                    && rect.top <= yClient && rect.bottom >= yClient;
-        };
-
-        bool foundIntersection = false;
-        for (auto i = 0u; i < surfaceLayout.pageRects.size(); ++i) {
-            if (isPtInRect(surfaceLayout.pageRects[i].pageRect)) {
-                if (this->selectionModel.IsSelected(i)) {
-                    this->selectionModel.Deselect(i, sm);
-                } else {
-                    this->selectionModel.Select(i, sm);
-                }
-                foundIntersection = true;
-                break;
-            }
-        }
-        if (!foundIntersection) {
+        int index = this->helper->PageAtPoint(LOWORD(lParam), HIWORD(lParam));
+        if (index == -1) {
             this->selectionModel.ClearSelection();
+        } else if (this->selectionModel.IsSelected(index)) {
+            this->selectionModel.Deselect(index, sm);
+        } else {
+            this->selectionModel.Select(index, sm);
         }
     }
 }
 
 void CDocumentView::OnDestroy(WPARAM, LPARAM)
 {
+    CDecodeWorkerPool::Instance().RemoveCompletionListener(this);
     this->selectionModel.SetModel(nullptr);
-    this->model.reset();
+    this->decodeScheduler->Clear();
+    this->clearPages();
 }
 
-void CDocumentView::OnDocumentAdded(IDocument* doc)
+void CDocumentView::OnDecodeCompleted(WPARAM, LPARAM)
 {
-    if (doc->GetPagesCount() == 0) {
-        return;
-    }
-    for (int i = 0; i < model->GetTotalPageCount(); ++i) {
-        auto page = reinterpret_cast<IPage*>(model->GetData(i, TDocumentModelRoles::PageRole));
-        if (page->GetDocument() != doc) {
-            continue;
-        }
-        auto format = reinterpret_cast<IDWriteTextFormat*>(model->GetData(i, TDocumentModelRoles::HeaderFontRole));
-        std::unique_ptr<wchar_t> headerText{(wchar_t*)model->GetData(i, TDocumentModelRoles::HeaderTextRole)};
-        this->helper->AddPage(page, format, std::wstring{headerText.get()});
-    }
-    this->Redraw();
+    // Uploads pages and fires their callbacks, which invalidate the view
+    CDecodeWorkerPool::Instance().DispatchCompleted();
+}
+
+void CDocumentView::OnCompletionsReady()
+{
+    PostMessage(this->window, WM_DECODE_COMPLETED, 0, 0);
+}
+
+void CDocumentView::OnDocumentChanged(IDocument*)
+{
+    // Many pages can finish loading at once, so they are painted together
+    InvalidateRect(this->window, nullptr, false);
 }
 
 void CDocumentView::OnDocumentDeleted(IDocument* doc)
@@ -419,9 +435,40 @@ void CDocumentView::OnDocumentDeleted(IDocument* doc)
     if (doc->GetPagesCount() == 0) {
         return;
     }
+    std::vector<const IPage*> pages;
+    pages.reserve(doc->GetPagesCount());
     for (int i = 0; i < doc->GetPagesCount(); ++i) {
-        this->helper->DeletePage(doc->GetPage(i));
+        pages.push_back(doc->GetPage(i));
+    }
+    // The pages may still be drawn until the layout without them is acquired
+    this->helper->DeletePages(pages, [this, pages, document = this->model->RetainDeletedDocument(doc)] {
+        this->decodeScheduler->Forget(pages);
+    });
+    this->Redraw();
+}
+
+void CDocumentView::OnPagesInserted(int firstIndex, int count)
+{
+    this->helper->InsertPages(*this->model, firstIndex, count);
+    this->Redraw();
+}
+
+void CDocumentView::OnModelUpdated(const CDocumentsModelChanges& changes)
+{
+    std::vector<const IPage*> deletedPages;
+    std::vector<std::shared_ptr<IDocument>> deletedDocuments;
+    for (auto doc : changes.deletedDocuments) {
+        for (int i = 0; i < doc->GetPagesCount(); ++i) {
+            deletedPages.push_back(doc->GetPage(i));
+        }
+        deletedDocuments.push_back(this->model->RetainDeletedDocument(doc));
     }
+    this->helper->DeletePages(deletedPages,
+        [this, deletedPages, deletedDocuments = std::move(deletedDocuments)] {
+            this->decodeScheduler->Forget(deletedPages);
+        }
+    );
+    this->helper->InsertPages(*this->model, changes.firstInsertedPage, changes.insertedPagesCount);
     this->Redraw();
 }
 
@@ -581,3 +628,18 @@ void CDocumentView::resize(int width, int height)
     }
     this->helper->SetRenderTargetSize(D2D1_SIZE_F{(float)width, (float)height});
 }
+
+void CDocumentView::clearPages()
+{
+    // The layout thread may still reference the pages, so the model is released when it is done
+    std::shared_ptr<IDocumentsModel> previousModel{this->model.release()};
+    this->helper->ClearPages([previousModel = std::move(previousModel)] {});
+}
+
+void CDocumentView::onLayoutPublished()
+{
+    // Runs on the layout thread, so only invalidate and let the UI thread paint
+    if (this->window != nullptr) {
+        InvalidateRect(this->window, nullptr, false);
+    }
+}
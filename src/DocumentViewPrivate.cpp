@@ -1,12 +1,24 @@
 #include "DocumentViewPrivate.h"
 
+#include <DecodeWorkerPool.h>
+#include <ImagingService.h>
 #include <IDocumentModel.h>
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <iostream>
 #include <memory>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define D2DILV_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #ifdef DEBUG
 #define DEBUG_VAR(x) std::cout << #x << '=' << x << "\n";
 #else
@@ -34,19 +46,6 @@ bool operator!=(const D2D1_RECT_F& lhs, const D2D1_RECT_F& rhs)
     return !(lhs == rhs);
 }
 
-IDWriteFactory* DirectWriteFactory()
-{
-    static CComPtr<IDWriteFactory> factory = nullptr;
-    if (factory == nullptr)
-    {
-        OK(DWriteCreateFactory(
-            DWRITE_FACTORY_TYPE_ISOLATED, __uuidof(IDWriteFactory),
-            reinterpret_cast<IUnknown**>(&factory.ptr)
-        ));
-    }
-    return factory.ptr;
-}
-
 std::ostream& operator<<(std::ostream& out, const SIZE& size)
 {
     return out << size.cx << ' ' << size.cy;
@@ -72,14 +71,317 @@ inline std::pair<float, float> WxH(const D2D1_RECT_F& rect)
     return {Width(rect), Height(rect)};
 }
 
+/// Number of pages from which vertical alignments are laid out on several threads
+constexpr size_t ParallelLayoutThreshold = 16384;
+
+/// @brief Split [first, last) into equal chunks, one per worker, and run fn(chunkIndex, chunkBegin, chunkEnd) for every chunk
+template<typename TFunction>
+void ForEachChunk(CLayoutWorkers& workers, size_t first, size_t last, TFunction&& fn)
+{
+    const size_t chunkSize = (last - first + workers.GetChunksCount() - 1) / workers.GetChunksCount();
+    workers.Run([&fn, first, last, chunkSize](size_t chunk) {
+        const size_t chunkBegin = std::min(last, first + chunk * chunkSize);
+        fn(chunk, chunkBegin, std::min(last, chunkBegin + chunkSize));
+    });
+}
+
+/// @brief Set bits of the rects visible in a group of them, the group may span two words of the mask
+/// @param position Bit of the first rect of the group
+/// @param visible Bit per rect of the group, at most 8 of them
+inline void SetVisibleBits(CVisibilityMask& mask, size_t position, uint64_t visible)
+{
+    const size_t shift = position % 64;
+    mask.bits[position / 64] |= visible << shift;
+    if (shift != 0 && (visible >> (64 - shift)) != 0) {
+        mask.bits[position / 64 + 1] |= visible >> (64 - shift);
+    }
+}
+
+/// @brief Cull rects whose coordinates are contiguous
+/// @param maskOffset Bit of the mask that corresponds to the first rect
+static void CullContiguousRects(const float* left, const float* top, const float* right, const float* bottom, size_t count,
+                                const D2D1_RECT_F& viewPortRect, CVisibilityMask& mask, size_t maskOffset)
+{
+    // Same test as a scalar intersection: rect is visible unless it lies entirely on one side of the viewport
+    size_t i = 0;
+#ifdef __AVX2__
+    {
+        const __m256 viewPortLeft = _mm256_set1_ps(viewPortRect.left);
+        const __m256 viewPortTop = _mm256_set1_ps(viewPortRect.top);
+        const __m256 viewPortRight = _mm256_set1_ps(viewPortRect.right);
+        const __m256 viewPortBottom = _mm256_set1_ps(viewPortRect.bottom);
+        for (; i + 8 <= count; i += 8) {
+            const __m256 horizontal = _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_loadu_ps(left + i), viewPortRight, _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_loadu_ps(right + i), viewPortLeft, _CMP_GE_OQ));
+            const __m256 vertical = _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_loadu_ps(top + i), viewPortBottom, _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_loadu_ps(bottom + i), viewPortTop, _CMP_GE_OQ));
+            const uint64_t visible = _mm256_movemask_ps(_mm256_and_ps(horizontal, vertical));
+            SetVisibleBits(mask, maskOffset + i, visible);
+        }
+    }
+#endif
+#ifdef D2DILV_SSE2
+    {
+        const __m128 viewPortLeft = _mm_set1_ps(viewPortRect.left);
+        const __m128 viewPortTop = _mm_set1_ps(viewPortRect.top);
+        const __m128 viewPortRight = _mm_set1_ps(viewPortRect.right);
+        const __m128 viewPortBottom = _mm_set1_ps(viewPortRect.bottom);
+        for (; i + 4 <= count; i += 4) {
+            const __m128 horizontal = _mm_and_ps(
+                _mm_cmple_ps(_mm_loadu_ps(left + i), viewPortRight),
+                _mm_cmpge_ps(_mm_loadu_ps(right + i), viewPortLeft));
+            const __m128 vertical = _mm_and_ps(
+                _mm_cmple_ps(_mm_loadu_ps(top + i), viewPortBottom),
+                _mm_cmpge_ps(_mm_loadu_ps(bottom + i), viewPortTop));
+            const uint64_t visible = _mm_movemask_ps(_mm_and_ps(horizontal, vertical));
+            SetVisibleBits(mask, maskOffset + i, visible);
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        const bool visible = left[i] <= viewPortRect.right && right[i] >= viewPortRect.left
+                && top[i] <= viewPortRect.bottom && bottom[i] >= viewPortRect.top;
+        SetVisibleBits(mask, maskOffset + i, uint64_t(visible));
+    }
+}
+
+void CullRects(const CRectArray& rects, size_t first, size_t last, const D2D1_RECT_F& viewPortRect, CVisibilityMask& mask)
+{
+    assert(first <= last && last <= rects.Size());
+    mask.bits.assign((last - first + 63) / 64, 0);
+
+    // Coordinates are contiguous within a chunk only, so the chunks are culled one by one
+    for (size_t chunkBegin = first; chunkBegin < last;) {
+        const size_t chunkEnd = std::min(last, rects.left.ChunkEnd(chunkBegin));
+        CullContiguousRects(rects.left.Data(chunkBegin), rects.top.Data(chunkBegin), rects.right.Data(chunkBegin),
+                            rects.bottom.Data(chunkBegin), chunkEnd - chunkBegin, viewPortRect, mask, chunkBegin - first);
+        chunkBegin = chunkEnd;
+    }
+}
+
+/// @brief Size of a header, which takes lines of lineSize when it is not wrapped
+static D2D1_SIZE_F WrapHeader(const D2D1_SIZE_F& lineSize, float maxWidth)
+{
+    // Wrapping is estimated by the number of full widths the text takes, word boundaries are not looked for
+    float width = lineSize.width;
+    float lines = 1.f;
+    if (maxWidth > 0.f && width > maxWidth) {
+        lines = std::ceil(width / maxWidth);
+        width = maxWidth;
+    }
+    // Headers get a 10% gap below the text
+    return {width, lineSize.height * lines * 11.f / 10.f};
+}
+
+D2D1_SIZE_F CDirectWriteTextMeasurer::Measure(IDWriteTextFormat* format, std::wstring_view text, float maxWidth)
+{
+    // Unique texts of all pages are kept at most
+    constexpr size_t maxCachedTexts = 1 << 16;
+
+    auto& metrics = metricsOf(format);
+    key.assign(text);
+    if (metrics.hasTabularDigits) {
+        std::replace_if(key.begin(), key.end(), [](wchar_t c) { return c > L'0' && c <= L'9'; }, L'0');
+    }
+    auto iter = metrics.lineSizes.find(key);
+    if (iter != metrics.lineSizes.end()) {
+        return WrapHeader(iter->second, maxWidth);
+    }
+
+    D2D1_SIZE_F lineSize{0.f, metrics.lineHeight};
+    if (metrics.fontFace == nullptr) {
+        CComPtr<IDWriteTextLayout> textLayout;
+        OK(CImagingService::Instance().GetDirectWriteFactory()->CreateTextLayout(text.data(), text.length(), format, maxWidth, 0.0f, &textLayout.ptr));
+
+        DWRITE_TEXT_METRICS textMetrics;
+        OK(textLayout->GetMetrics(&textMetrics));
+        if (textMetrics.lineCount > 1) {
+            // Wrapped at words, the size is only valid for this width
+            return {textMetrics.widthIncludingTrailingWhitespace, textMetrics.height * 11.f / 10.f};
+        }
+        lineSize = {textMetrics.widthIncludingTrailingWhitespace, textMetrics.height};
+    } else {
+        for (size_t i = 0; i < text.length(); ++i) {
+            uint32_t codePoint = text[i];
+            // Windows wchar_t is UTF-16, so characters out of BMP take two code units
+            if (codePoint >= 0xD800 && codePoint < 0xDC00 && i + 1 < text.length()
+                    && text[i + 1] >= 0xDC00 && text[i + 1] < 0xE000) {
+                codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (text[i + 1] - 0xDC00);
+                ++i;
+            }
+            lineSize.width += advanceOf(metrics, codePoint);
+        }
+    }
+
+    if (metrics.lineSizes.size() >= maxCachedTexts) {
+        metrics.lineSizes.clear();
+    }
+    metrics.lineSizes.emplace(key, lineSize);
+    return WrapHeader(lineSize, maxWidth);
+}
+
+CDirectWriteTextMeasurer::CFontMetrics& CDirectWriteTextMeasurer::metricsOf(IDWriteTextFormat* format)
+{
+    auto [iter, inserted] = fonts.try_emplace(format);
+    auto& metrics = iter->second;
+    if (!inserted) {
+        return metrics;
+    }
+    format->AddRef();
+    metrics.format.ptr = format;
+
+    // Any failure leaves the font face empty, so the text is measured with a text layout instead
+    CComPtr<IDWriteFontCollection> fontCollection;
+    if (format->GetFontCollection(&fontCollection.ptr) != S_OK || fontCollection == nullptr) {
+        fontCollection.Reset();
+        if (CImagingService::Instance().GetDirectWriteFactory()->GetSystemFontCollection(&fontCollection.ptr) != S_OK) {
+            return metrics;
+        }
+    }
+
+    std::wstring familyName(format->GetFontFamilyNameLength() + 1, L'\0');
+    UINT32 familyIndex = 0;
+    BOOL exists = FALSE;
+    if (format->GetFontFamilyName(familyName.data(), familyName.size()) != S_OK
+            || fontCollection->FindFamilyName(familyName.c_str(), &familyIndex, &exists) != S_OK
+            || !exists) {
+        return metrics;
+    }
+
+    CComPtr<IDWriteFontFamily> fontFamily;
+    CComPtr<IDWriteFont> font;
+    if (fontCollection->GetFontFamily(familyIndex, &fontFamily.ptr) != S_OK
+            || fontFamily->GetFirstMatchingFont(format->GetFontWeight(), format->GetFontStretch(), format->GetFontStyle(), &font.ptr) != S_OK
+            || font->CreateFontFace(&metrics.fontFace.ptr) != S_OK) {
+        metrics.fontFace.Reset();
+        return metrics;
+    }
+
+    DWRITE_FONT_METRICS fontMetrics;
+    metrics.fontFace->GetMetrics(&fontMetrics);
+    metrics.designUnitsToDips = format->GetFontSize() / fontMetrics.designUnitsPerEm;
+    // Default line spacing of DirectWrite
+    metrics.lineHeight = (fontMetrics.ascent + fontMetrics.descent + fontMetrics.lineGap) * metrics.designUnitsToDips;
+
+    metrics.hasTabularDigits = true;
+    for (uint32_t digit = L'1'; digit <= L'9'; ++digit) {
+        metrics.hasTabularDigits = metrics.hasTabularDigits && advanceOf(metrics, digit) == advanceOf(metrics, L'0');
+    }
+    return metrics;
+}
+
+float CDirectWriteTextMeasurer::advanceOf(CFontMetrics& metrics, uint32_t codePoint)
+{
+    auto [iter, inserted] = metrics.advances.try_emplace(codePoint, 0.f);
+    if (inserted) {
+        UINT16 glyphIndex = 0;
+        DWRITE_GLYPH_METRICS glyphMetrics{};
+        if (metrics.fontFace->GetGlyphIndices(&codePoint, 1, &glyphIndex) == S_OK
+                && metrics.fontFace->GetDesignGlyphMetrics(&glyphIndex, 1, &glyphMetrics) == S_OK) {
+            iter->second = glyphMetrics.advanceWidth * metrics.designUnitsToDips;
+        }
+    }
+    return iter->second;
+}
+
+D2D1_SIZE_F CFixedTextMeasurer::Measure(IDWriteTextFormat*, std::wstring_view text, float maxWidth)
+{
+    return WrapHeader({text.length() * characterWidth, lineHeight}, maxWidth);
+}
+
+IDWriteTextLayout* CHeaderLayoutCache::Find(const IPage* page)
+{
+    auto iter = entriesByPage.find(page);
+    if (iter == entriesByPage.end()) {
+        return nullptr;
+    }
+    entries.splice(entries.begin(), entries, iter->second);
+    return iter->second->second.ptr;
+}
+
+IDWriteTextLayout* CHeaderLayoutCache::Insert(const IPage* page, CComPtr<IDWriteTextLayout> textLayout)
+{
+    assert(entriesByPage.find(page) == entriesByPage.end());
+    if (entries.size() >= capacity) {
+        entriesByPage.erase(entries.back().first);
+        entries.pop_back();
+    }
+    entries.emplace_front(page, std::move(textLayout));
+    entriesByPage[page] = entries.begin();
+    return entries.front().second.ptr;
+}
+
+void CHeaderLayoutCache::Erase(const IPage* page)
+{
+    auto iter = entriesByPage.find(page);
+    if (iter != entriesByPage.end()) {
+        entries.erase(iter->second);
+        entriesByPage.erase(iter);
+    }
+}
+
+void CHeaderLayoutCache::Clear()
+{
+    entriesByPage.clear();
+    entries.clear();
+}
+
+void CHeaderLayoutCache::SetCapacity(size_t capacity)
+{
+    this->capacity = std::max<size_t>(capacity, 1);
+    while (entries.size() > this->capacity) {
+        entriesByPage.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+/// Scroll events fade out of the velocity with this time constant
+constexpr float VelocityFadeSeconds = 0.25f;
+
+void CScrollVelocity::Add(float distance)
+{
+    velocity = this->Get() + distance / VelocityFadeSeconds;
+    lastScroll = CClock::now();
+}
+
+float CScrollVelocity::Get() const
+{
+    const float elapsed = std::chrono::duration<float>(CClock::now() - lastScroll).count();
+    return velocity * std::exp(-elapsed / VelocityFadeSeconds);
+}
+
+CDocumentLayoutHelper::CDocumentLayoutHelper(std::function<void()> onLayoutPublished) :
+    layout{std::make_shared<const CDocumentPagesLayout>()},
+    onLayoutPublished{std::move(onLayoutPublished)},
+    publishedLayout{layout}
+{
+    layoutThread = std::thread{&CDocumentLayoutHelper::runLayoutThread, this};
+}
+
+CDocumentLayoutHelper::~CDocumentLayoutHelper()
+{
+    {
+        std::lock_guard lock{jobsMutex};
+        isStopping = true;
+    }
+    jobsChanged.notify_all();
+    layoutThread.join();
+    // Callbacks of the pages still retired are dropped without a call, that releases what they keep alive
+    retiredPages.clear();
+}
+
 void CDocumentLayoutHelper::SetRenderTargetSize(const D2D1_SIZE_F& renderTargetSize)
 {
+    const bool isWidthChanged = this->renderTargetSize.width != renderTargetSize.width;
     this->renderTargetSize = renderTargetSize;
-     if (strategy == TImagesViewAlignment::HorizontalFlow) {
-        this->RefreshLayout();
-    } else {
-        this->calcScrollBars();
+    if (strategy == TImagesViewAlignment::HorizontalFlow && isWidthChanged) {
+        this->requestLayout([](CDocumentLayoutEngine& engine) {
+            engine.Reflow();
+        });
     }
+    this->calcScrollBars();
 }
 
 void CDocumentLayoutHelper::SetPageMargin(int margin)
@@ -108,8 +410,11 @@ void CDocumentLayoutHelper::SetVScroll(float vScroll)
 
 void CDocumentLayoutHelper::AddVScroll(float delta)
 {
+    const float previousVScroll = this->vScroll;
     this->vScroll += delta;
     this->calcScrollBars();
+    // Scroll is negative and relative to the surface height, so scrolling down decreases it
+    this->vScrollVelocity.Add((previousVScroll - this->vScroll) * layout->totalSurfaceSize.height);
 }
 
 void CDocumentLayoutHelper::SetHScroll(float hScroll)
@@ -128,25 +433,21 @@ void CDocumentLayoutHelper::SetZoom(float zoom)
 {
     this->zoom = zoom;
     if (strategy == TImagesViewAlignment::HorizontalFlow) {
-        this->RefreshLayout();
-    } else {
-        this->calcScrollBars();
+        this->requestLayout([](CDocumentLayoutEngine& engine) {
+            engine.Reflow();
+        });
     }
+    this->calcScrollBars();
 }
 
 void CDocumentLayoutHelper::AddZoom(float delta)
 {
-    this->zoom += delta;
-    if (strategy == TImagesViewAlignment::HorizontalFlow) {
-        this->RefreshLayout();
-    } else {
-        this->calcScrollBars();
-    }
+    this->SetZoom(this->zoom + delta);
 }
 
 const CDocumentPagesLayout& CDocumentLayoutHelper::GetLayout() const
 {
-    return layout;
+    return *layout;
 }
 
 const CScrollBarRects& CDocumentLayoutHelper::GetRelativeScrollBarRects() const
@@ -154,97 +455,759 @@ const CScrollBarRects& CDocumentLayoutHelper::GetRelativeScrollBarRects() const
     return relativeScrollRects;
 }
 
-void CDocumentLayoutHelper::AddPage(const IPage* page, IDWriteTextFormat* format, std::wstring headerText)
+bool CDocumentLayoutHelper::AcquireLayout()
+{
+    auto latest = std::atomic_load(&publishedLayout);
+    const uint64_t publishedGeneration = latest->generation;
+    // The published snapshot is older than the acquired one if the pages were cleared after it was requested
+    const bool isChanged = latest != layout && latest->generation >= layout->generation;
+    if (isChanged) {
+        layout = std::move(latest);
+        calcScrollBars();
+    }
+    this->releaseRetiredPages(publishedGeneration);
+    return isChanged;
+}
+
+bool CDocumentLayoutHelper::IsLayoutCurrent() const
+{
+    return layout->generation == requestedGeneration;
+}
+
+void CDocumentLayoutHelper::WaitForLayout()
+{
+    {
+        std::unique_lock lock{jobsMutex};
+        jobsChanged.wait(lock, [this] {
+            return jobs.empty() && !isEngineBusy;
+        });
+    }
+    AcquireLayout();
+}
+
+D2D1_RECT_F CDocumentLayoutHelper::GetViewportRect() const
+{
+    return {
+        -viewportOffset.width / this->zoom - layout->columnOffset,
+        -viewportOffset.height / this->zoom,
+        (-viewportOffset.width + renderTargetSize.width) / this->zoom - layout->columnOffset,
+        (-viewportOffset.height + renderTargetSize.height) / this->zoom
+    };
+}
+
+std::pair<size_t, size_t> CDocumentLayoutHelper::QueryVisible(const D2D1_RECT_F& viewPortRect) const
+{
+    const auto& rows = layout->rows;
+    // Rows are monotonic in both top and bottom, so the first visible row is the first one
+    // that ends below the viewport top and the last one is the last that starts above its bottom
+    auto firstRow = std::lower_bound(rows.begin(), rows.end(), viewPortRect.top,
+        [](const auto& row, float top) {
+            return row.bottom < top;
+        }
+    );
+    auto lastRow = std::upper_bound(firstRow, rows.end(), viewPortRect.bottom,
+        [](float bottom, const auto& row) {
+            return bottom < row.top;
+        }
+    );
+    if (firstRow == lastRow) {
+        return {0, 0};
+    }
+    const size_t first = firstRow->firstPage;
+    const size_t last = lastRow == rows.end() ? layout->GetPagesCount() : lastRow->firstPage;
+    return {first, last};
+}
+
+int CDocumentLayoutHelper::PageAtPoint(float x, float y) const
+{
+    // Same transform as the one used for drawing: scale by zoom, then translate by viewport offset
+    const float xSurface = (x - viewportOffset.width) / this->zoom - layout->columnOffset;
+    const float ySurface = (y - viewportOffset.height) / this->zoom;
+
+    const auto& rows = layout->rows;
+    auto nextRow = std::upper_bound(rows.begin(), rows.end(), ySurface,
+        [](float y, const auto& row) {
+            return y < row.top;
+        }
+    );
+    if (nextRow == rows.begin()) {
+        return -1;
+    }
+    auto row = std::prev(nextRow);
+    if (ySurface > row->bottom) {
+        return -1;
+    }
+
+    // Pages of a row are ordered from left to right
+    const auto& lefts = layout->pageRects.left;
+    auto rowBegin = lefts.begin() + row->firstPage;
+    auto rowEnd = nextRow == rows.end() ? lefts.end() : lefts.begin() + nextRow->firstPage;
+    auto nextPage = std::upper_bound(rowBegin, rowEnd, xSurface);
+    if (nextPage == rowBegin) {
+        return -1;
+    }
+    const int index = std::prev(nextPage) - lefts.begin();
+    const auto pageRect = layout->pageRects[index];
+    if (pageRect.left <= xSurface && pageRect.right >= xSurface
+            && pageRect.top <= ySurface && pageRect.bottom >= ySurface) {
+        return index;
+    }
+    return -1;
+}
+
+IDWriteTextLayout* CDocumentLayoutHelper::GetHeaderLayout(size_t index)
+{
+    assert(index < layout->GetPagesCount());
+    const auto page = layout->pages[index];
+    if (auto textLayout = headerLayouts.Find(page); textLayout != nullptr) {
+        return textLayout;
+    }
+
+    const auto text = layout->headerTexts[index];
+    CComPtr<IDWriteTextLayout> textLayout;
+    OK(CImagingService::Instance().GetDirectWriteFactory()->CreateTextLayout(
+        text.data(), text.length(), layout->headerFormats[index], (float)layout->pageSizes[index].cx, 0.0f, &textLayout.ptr
+    ));
+    return headerLayouts.Insert(page, std::move(textLayout));
+}
+
+void CDocumentLayoutHelper::ReserveHeaderLayouts(size_t visibleCount)
+{
+    // Twice the visible count keeps the headers of the previous screen while scrolling
+    headerLayouts.SetCapacity(std::max(MinHeaderLayouts, visibleCount * 2));
+}
+
+void CDocumentLayoutHelper::AddPage(const IPage* page, IDWriteTextFormat* format, std::wstring_view headerText)
 {
     TRACE()
 
-    auto absoluteLayout = createAbsolutePageLayout(page, format, headerText);
-    adjustLayoutForCurrentAlignment(absoluteLayout);
-    layout.pageRects.push_back(std::move(absoluteLayout));
+    std::vector<CPageInfo> pageInfos{CPageInfo{page, page->GetPageSize(), headerText, format}};
+    this->requestLayout([pageInfos = std::move(pageInfos)](CDocumentLayoutEngine& engine) {
+        engine.InsertPages(engine.GetLayout().GetPagesCount(), pageInfos);
+    });
+}
 
+void CDocumentLayoutHelper::InsertPages(const IDocumentsModel& model, int firstIndex, int count)
+{
+    TRACE()
+
+    if (count <= 0) {
+        return;
+    }
+    std::vector<CPageInfo> pageInfos(count);
+    model.GetPages(firstIndex, count, pageInfos.data());
+    this->requestLayout([firstIndex, pageInfos = std::move(pageInfos)](CDocumentLayoutEngine& engine) {
+        engine.InsertPages(firstIndex, pageInfos);
+    });
+}
+
+void CDocumentLayoutHelper::DeletePage(const std::variant<const IPage*, int>& page, std::function<void()> onReleased)
+{
+    TRACE()
+
+    this->requestLayout([page](CDocumentLayoutEngine& engine) {
+        engine.DeletePage(page);
+    });
+    const bool isIndex = std::holds_alternative<int>(page);
+    std::vector<const IPage*> pages;
+    if (!isIndex) {
+        pages.push_back(std::get<const IPage*>(page));
+    }
+    retiredPages.push_back(CRetiredPages{requestedGeneration, std::move(pages), isIndex, std::move(onReleased)});
+}
+
+void CDocumentLayoutHelper::DeletePages(const std::vector<const IPage*>& pages, std::function<void()> onReleased)
+{
+    TRACE()
+
+    if (pages.empty()) {
+        if (onReleased) {
+            onReleased();
+        }
+        return;
+    }
+    this->requestLayout([pages](CDocumentLayoutEngine& engine) {
+        engine.DeletePages(pages);
+    });
+    retiredPages.push_back(CRetiredPages{requestedGeneration, pages, false, std::move(onReleased)});
+}
+
+void CDocumentLayoutHelper::ClearPages(std::function<void()> onReleased)
+{
+    this->requestLayout([](CDocumentLayoutEngine& engine) {
+        engine.ClearPages();
+    });
+    // Nothing is drawn from the old pages from now on, only the layout thread may still reference them
+    auto cleared = std::make_shared<CDocumentPagesLayout>();
+    cleared->generation = requestedGeneration;
+    layout = std::move(cleared);
+    headerLayouts.Clear();
     calcScrollBars();
+    retiredPages.push_back(CRetiredPages{requestedGeneration, {}, false, std::move(onReleased)});
 }
 
-void CDocumentLayoutHelper::DeletePage(const std::variant<const IPage*, int>& page)
+void CDocumentLayoutHelper::RefreshLayout()
+{
+    this->requestLayout([](CDocumentLayoutEngine& engine) {
+        engine.RefreshLayout();
+    });
+}
+
+void CDocumentLayoutHelper::SetTextMeasurer(std::shared_ptr<ITextMeasurer> measurer)
+{
+    this->requestLayout([measurer = std::move(measurer)](CDocumentLayoutEngine& engine) {
+        engine.SetTextMeasurer(measurer);
+    });
+}
+
+CLayoutParameters CDocumentLayoutHelper::parameters() const
+{
+    return {renderTargetSize.width / std::max(this->zoom, 0.1f), pageMargin, pagesSpacing, strategy};
+}
+
+void CDocumentLayoutHelper::requestLayout(CLayoutJob job)
+{
+    // Every request carries the parameters it was made with, so the engine sees them in order
+    {
+        std::lock_guard lock{jobsMutex};
+        jobs.emplace_back(++requestedGeneration,
+            [parameters = this->parameters(), job = std::move(job)](CDocumentLayoutEngine& engine) {
+                engine.SetParameters(parameters);
+                job(engine);
+            }
+        );
+    }
+    jobsChanged.notify_all();
+}
+
+void CDocumentLayoutHelper::releaseRetiredPages(uint64_t publishedGeneration)
+{
+    // The pages are referenced until the layout thread has deleted them and the acquired snapshot is not older
+    const uint64_t releasedGeneration = std::min(publishedGeneration, layout->generation);
+    while (!retiredPages.empty() && retiredPages.front().generation <= releasedGeneration) {
+        auto retired = std::move(retiredPages.front());
+        retiredPages.pop_front();
+        if (retired.isUnknownPages) {
+            headerLayouts.Clear();
+        }
+        for (auto page : retired.pages) {
+            headerLayouts.Erase(page);
+        }
+        if (retired.onReleased) {
+            retired.onReleased();
+        }
+    }
+}
+
+void CDocumentLayoutHelper::runLayoutThread()
+{
+    std::unique_lock lock{jobsMutex};
+    while (true) {
+        jobsChanged.wait(lock, [this] {
+            return isStopping || !jobs.empty();
+        });
+        if (isStopping) {
+            return;
+        }
+
+        // Take all queued requests at once, a single snapshot is published for them
+        auto batch = std::move(jobs);
+        jobs.clear();
+        isEngineBusy = true;
+        lock.unlock();
+
+        for (auto& [generation, job] : batch) {
+            job(engine);
+        }
+        // The snapshot shares the chunks of the engine arrays, the engine clones the ones it changes later
+        auto snapshot = std::make_shared<CDocumentPagesLayout>(engine.GetLayout());
+        snapshot->generation = batch.back().first;
+        std::atomic_store(&publishedLayout, std::shared_ptr<const CDocumentPagesLayout>{std::move(snapshot)});
+        if (onLayoutPublished) {
+            onLayoutPublished();
+        }
+
+        lock.lock();
+        isEngineBusy = false;
+        jobsChanged.notify_all();
+    }
+}
+
+CLayoutWorkers::CLayoutWorkers(size_t chunksCount) : chunksCount{std::max<size_t>(chunksCount, 1)}
+{
+}
+
+CLayoutWorkers::~CLayoutWorkers()
 {
     TRACE()
 
+    {
+        std::lock_guard lock{mutex};
+        isStopping = true;
+    }
+    jobStarted.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void CLayoutWorkers::Run(const std::function<void(size_t chunk)>& job)
+{
+    // Most views never have enough pages to lay them out in parallel, so threads are started on demand
+    if (threads.empty() && chunksCount > 1) {
+        threads.reserve(chunksCount - 1);
+        for (size_t chunk = 1; chunk < chunksCount; ++chunk) {
+            threads.emplace_back([this, chunk] { this->runThread(chunk); });
+        }
+    }
+
+    {
+        std::lock_guard lock{mutex};
+        this->job = &job;
+        runningChunks = chunksCount - 1;
+        ++jobGeneration;
+    }
+    jobStarted.notify_all();
+
+    job(0);
+
+    std::unique_lock lock{mutex};
+    chunkFinished.wait(lock, [this] { return runningChunks == 0; });
+    this->job = nullptr;
+}
+
+void CLayoutWorkers::runThread(size_t chunk)
+{
+    uint64_t doneGeneration = 0;
+    std::unique_lock lock{mutex};
+    while (true) {
+        jobStarted.wait(lock, [this, doneGeneration] { return isStopping || jobGeneration != doneGeneration; });
+        if (isStopping) {
+            break;
+        }
+        // Run waits for every chunk of a job, so no generation is skipped
+        doneGeneration = jobGeneration;
+        const auto& currentJob = *job;
+
+        lock.unlock();
+        currentJob(chunk);
+        lock.lock();
+
+        if (--runningChunks == 0) {
+            chunkFinished.notify_one();
+        }
+    }
+}
+
+void CDocumentLayoutEngine::SetParameters(const CLayoutParameters& parameters)
+{
+    this->surfaceWidth = parameters.surfaceWidth;
+    this->pageMargin = parameters.pageMargin;
+    this->pagesSpacing = parameters.pagesSpacing;
+    this->strategy = parameters.strategy;
+}
+
+void CDocumentLayoutEngine::SetTextMeasurer(std::shared_ptr<ITextMeasurer> measurer)
+{
+    TRACE()
+
+    NOTNULL(measurer);
+    textMeasurer = std::move(measurer);
+    for (size_t i = 0; i < layout.GetPagesCount(); ++i) {
+        const CPageInfo pageInfo{layout.pages[i], layout.pageSizes[i], layout.headerTexts[i], layout.headerFormats[i]};
+        storePageLayout(i, createAbsolutePageLayout(pageInfo));
+    }
+    RefreshLayout();
+}
+
+void CDocumentLayoutEngine::InsertPages(size_t firstIndex, const std::vector<CPageInfo>& pageInfos)
+{
+    TRACE()
+
+    assert(firstIndex <= layout.GetPagesCount());
+    const size_t count = pageInfos.size();
+    if (count == 0) {
+        return;
+    }
+
+    const bool isAppend = (size_t)firstIndex == layout.GetPagesCount();
+    layout.pages.Insert(firstIndex, count, nullptr);
+    layout.pageSizes.Insert(firstIndex, count, SIZE{0, 0});
+    layout.headerTexts.Insert(firstIndex, count, std::wstring_view{});
+    layout.headerFormats.Insert(firstIndex, count, nullptr);
+    layout.textRects.Insert(firstIndex, count);
+    layout.pageRects.Insert(firstIndex, count);
+
+    for (size_t i = firstIndex; i < firstIndex + count; ++i) {
+        const auto& pageInfo = pageInfos[i - firstIndex];
+        layout.pageSizes.Set(i, pageInfo.size);
+        auto absoluteLayout = createAbsolutePageLayout(pageInfo);
+        if (isAppend) {
+            adjustLayoutForCurrentAlignment(absoluteLayout, i);
+        }
+        layout.pages.Set(i, pageInfo.page);
+        layout.headerTexts.Set(i, pageInfo.headerText);
+        layout.headerFormats.Set(i, pageInfo.headerFont);
+        storePageLayout(i, absoluteLayout);
+    }
+
+    if (!isAppend) {
+        relayoutFrom(firstIndex);
+    }
+}
+
+void CDocumentLayoutEngine::DeletePage(const std::variant<const IPage*, int>& page)
+{
+    TRACE()
+
+    size_t index = 0;
     if (std::holds_alternative<int>(page))
     {
-        int index = std::get<int>(page);
-        assert(0 <= index && index < layout.pageRects.size());
-        layout.pageRects.erase(layout.pageRects.begin() + index);
+        index = std::get<int>(page);
+        assert(index < layout.GetPagesCount());
     }
     else
     {
-        auto pagePtr = std::get<const IPage*>(page);
-        auto iter = std::find_if(layout.pageRects.begin(), layout.pageRects.end(),
-            [pagePtr](const auto& pageLayout) {
-                return pageLayout.page == pagePtr;
-            }
-        );
-        assert(iter != layout.pageRects.end());
-        layout.pageRects.erase(iter);
+        auto iter = std::find(layout.pages.begin(), layout.pages.end(), std::get<const IPage*>(page));
+        assert(iter != layout.pages.end());
+        index = iter - layout.pages.begin();
     }
-    RefreshLayout();
+    layout.pages.Erase(index, index + 1);
+    layout.pageSizes.Erase(index, index + 1);
+    layout.headerTexts.Erase(index, index + 1);
+    layout.headerFormats.Erase(index, index + 1);
+    layout.textRects.Erase(index);
+    layout.pageRects.Erase(index);
+    relayoutFrom(index);
 }
 
-void CDocumentLayoutHelper::ClearPages()
+void CDocumentLayoutEngine::DeletePages(const std::vector<const IPage*>& pages)
+{
+    TRACE()
+
+    if (pages.empty()) {
+        return;
+    }
+
+    const std::unordered_set<const IPage*> deletedPages{pages.begin(), pages.end()};
+    auto isDeleted = [&deletedPages](const IPage* page) {
+        return deletedPages.find(page) != deletedPages.end();
+    };
+
+    auto firstDeleted = std::find_if(layout.pages.begin(), layout.pages.end(), isDeleted);
+    if (firstDeleted == layout.pages.end()) {
+        return;
+    }
+    const size_t index = firstDeleted - layout.pages.begin();
+
+    // Compact all arrays in one pass. Rects are only moved for their sizes, relayout places them.
+    size_t keptCount = index;
+    for (size_t i = index; i < layout.GetPagesCount(); ++i) {
+        if (isDeleted(layout.pages[i])) {
+            continue;
+        }
+        layout.pages.Set(keptCount, layout.pages[i]);
+        layout.pageSizes.Set(keptCount, layout.pageSizes[i]);
+        layout.headerTexts.Set(keptCount, layout.headerTexts[i]);
+        layout.headerFormats.Set(keptCount, layout.headerFormats[i]);
+        layout.textRects.Set(keptCount, layout.textRects[i]);
+        layout.pageRects.Set(keptCount, layout.pageRects[i]);
+        ++keptCount;
+    }
+    layout.pages.Resize(keptCount);
+    layout.pageSizes.Resize(keptCount);
+    layout.headerTexts.Resize(keptCount);
+    layout.headerFormats.Resize(keptCount);
+    layout.textRects.Resize(keptCount);
+    layout.pageRects.Resize(keptCount);
+
+    relayoutFrom(index);
+}
+
+void CDocumentLayoutEngine::ClearPages()
 {
     layout = CDocumentPagesLayout{};
 }
 
-void CDocumentLayoutHelper::RefreshLayout()
+void CDocumentLayoutEngine::RefreshLayout()
 {
     auto& retval = layout;
+    retval.totalSurfaceSize = {0.f, 0.f};
+    retval.columnOffset = 0.f;
     retval.alignmentContextValue1 = 0.f;
     retval.alignmentContextValue2 = 0.f;
     retval.alignmentContextValue3 = 0.f;
     retval.alignmentContextValue4 = 0.f;
+    retval.rows.Clear();
+
+    layoutPagesFrom(0);
+}
+
+void CDocumentLayoutEngine::relayoutFrom(size_t index)
+{
+    auto& retval = layout;
+    auto& rows = retval.rows;
+
+    // Row that holds the first changed page. Everything above it keeps its place.
+    auto nextRow = std::upper_bound(rows.begin(), rows.end(), index,
+        [](size_t index, const auto& row) {
+            return index < row.firstPage;
+        }
+    );
+    auto row = nextRow == rows.begin() ? rows.begin() : std::prev(nextRow);
+    // In flow mode the pages that follow the changed one may now fit into the previous row
+    if (strategy == TImagesViewAlignment::HorizontalFlow && row != rows.begin()) {
+        --row;
+    }
+    if (row == rows.begin()) {
+        RefreshLayout();
+        return;
+    }
+    const auto& previousRow = *std::prev(row);
 
-    for (auto& pageRect : retval.pageRects)
+    // Restore alignment context as it was after the previous row
+    switch (strategy)
     {
-        {
-            auto [pageWidth, pageHeight] = pageRect.page->GetPageSize();
-            auto [textWidth, textHeight] = WxH(pageRect.textRect);
-            pageRect.textRect = {0.f, 0.f, textWidth, textHeight};
-            pageRect.pageRect = {0.f, textHeight, (float)pageWidth, textHeight + (float)pageHeight};
+    case TImagesViewAlignment::AlignLeft:
+    {
+        retval.alignmentContextValue1 = row->top;
+        retval.alignmentContextValue2 = previousRow.runningWidth;
+        retval.totalSurfaceSize = {previousRow.runningWidth, previousRow.bottom};
+        break;
+    }
+    case TImagesViewAlignment::AlignRight:
+    case TImagesViewAlignment::AlignHCenter:
+    {
+        retval.alignmentContextValue1 = previousRow.runningWidth;
+        retval.alignmentContextValue2 = row->top;
+        retval.totalSurfaceSize = {previousRow.runningWidth + pageMargin * 2, previousRow.bottom};
+        retval.columnOffset = columnAnchor(previousRow.runningWidth);
+        break;
+    }
+    case TImagesViewAlignment::HorizontalFlow:
+    {
+        retval.alignmentContextValue1 = previousRow.runningWidth;
+        retval.alignmentContextValue2 = row->top;
+        retval.alignmentContextValue3 = 0.f;
+        retval.alignmentContextValue4 = 0.f;
+        retval.totalSurfaceSize = {previousRow.runningWidth - pagesSpacing, previousRow.bottom - pagesSpacing};
+        break;
+    }
+    default:
+        break;
+    }
+
+    const size_t first = row->firstPage;
+    rows.Resize(row - rows.begin());
+    layoutPagesFrom(first);
+}
+
+void CDocumentLayoutEngine::layoutPagesFrom(size_t first)
+{
+    if (strategy != TImagesViewAlignment::HorizontalFlow
+            && layout.GetPagesCount() - first >= ParallelLayoutThreshold
+            && workers.GetChunksCount() > 1) {
+        layoutVerticalPagesFrom(first);
+        return;
+    }
+
+    for (size_t i = first; i < layout.GetPagesCount(); ++i)
+    {
+        auto absoluteLayout = loadPageLayout(i);
+        adjustLayoutForCurrentAlignment(absoluteLayout, i);
+        storePageLayout(i, absoluteLayout);
+    }
+}
+
+void CDocumentLayoutEngine::layoutVerticalPagesFrom(size_t first)
+{
+    assert(strategy != TImagesViewAlignment::HorizontalFlow);
+    assert(layout.rows.Size() == first);
+
+    // Vertical alignments are a running sum of row heights and a running max of widths,
+    // so they are laid out as a parallel scan: chunk totals first, then every chunk from its base.
+    const bool isLeft = strategy == TImagesViewAlignment::AlignLeft;
+    float& topOffset = isLeft ? layout.alignmentContextValue1 : layout.alignmentContextValue2;
+    float& maxWidth = isLeft ? layout.alignmentContextValue2 : layout.alignmentContextValue1;
+    const float margins = pageMargin * 2.f;
+    auto rowSize = [this, isLeft, margins](size_t index) {
+        const auto& pageSize = layout.pageSizes[index];
+        const float textHeight = layout.textRects.bottom[index] - layout.textRects.top[index];
+        return std::make_pair(
+            pageSize.cx + (isLeft ? margins : 0.f),
+            pageSize.cy + margins + textHeight
+        );
+    };
+
+    const size_t last = layout.GetPagesCount();
+    const size_t chunksCount = workers.GetChunksCount();
+    struct CChunk {
+        float height = 0.f;
+        float maxWidth = 0.f;
+    };
+    std::vector<CChunk> chunks(chunksCount);
+    ForEachChunk(workers, first, last, [&](size_t chunk, size_t chunkBegin, size_t chunkEnd) {
+        auto& result = chunks[chunk];
+        for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+            const auto [width, height] = rowSize(i);
+            result.height += height + pagesSpacing;
+            result.maxWidth = std::max(result.maxWidth, width);
         }
-        auto& absoluteLayout = pageRect;
-        adjustLayoutForCurrentAlignment(absoluteLayout);
+    });
+
+    // Exclusive scan of the chunk totals turns them into the chunk bases
+    for (auto& chunk : chunks) {
+        const CChunk total = chunk;
+        chunk = {topOffset, maxWidth};
+        topOffset += total.height;
+        maxWidth = std::max(maxWidth, total.maxWidth);
     }
 
-    calcScrollBars();
+    // Chunks shared with the published layout are cloned here, so the threads only set elements
+    layout.rows.Resize(last);
+    layout.rows.MakeUnique(first, last);
+    layout.textRects.MakeUnique(first, last);
+    layout.pageRects.MakeUnique(first, last);
+    ForEachChunk(workers, first, last, [&](size_t chunk, size_t chunkBegin, size_t chunkEnd) {
+        float rowTop = chunks[chunk].height;
+        float runningWidth = chunks[chunk].maxWidth;
+        for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+            const auto [width, height] = rowSize(i);
+            runningWidth = std::max(runningWidth, width);
+
+            auto absoluteLayout = loadPageLayout(i);
+            adjustPage(absoluteLayout, rowTop, 0.f);
+            storePageLayout(i, absoluteLayout);
+            layout.rows.Set(i, {i, rowTop, rowTop + height, runningWidth});
+            rowTop += height + pagesSpacing;
+        }
+    });
+
+    if (isLeft) {
+        layout.totalSurfaceSize = {maxWidth, topOffset - pagesSpacing};
+    } else {
+        layout.totalSurfaceSize = {maxWidth + margins, topOffset - pagesSpacing};
+        layout.columnOffset = columnAnchor(maxWidth);
+    }
+}
+
+void CDocumentLayoutEngine::Reflow()
+{
+    auto& rows = layout.rows;
+    auto firstInvalid = std::find_if(rows.begin(), rows.end(),
+        [this](const auto& row) {
+            return !isFlowRowValid(row);
+        }
+    );
+    if (firstInvalid == rows.end()) {
+        return;
+    }
+    if (firstInvalid == rows.begin()) {
+        layout.totalSurfaceSize = {0.f, 0.f};
+        layout.alignmentContextValue1 = 0.f;
+        layout.alignmentContextValue2 = 0.f;
+        layout.alignmentContextValue3 = 0.f;
+        layout.alignmentContextValue4 = 0.f;
+    } else {
+        restoreFlowContext(*std::prev(firstInvalid));
+    }
+    const std::vector<CDocumentPagesLayout::CRow> oldRows{firstInvalid, rows.end()};
+    rows.Resize(firstInvalid - rows.begin());
+
+    size_t oldRow = 0;
+    for (size_t i = oldRows.front().firstPage; i < layout.GetPagesCount();)
+    {
+        auto absoluteLayout = loadPageLayout(i);
+        adjustLayoutForCurrentAlignment(absoluteLayout, i);
+        storePageLayout(i, absoluteLayout);
+        const size_t rowStart = i++;
+        if (rows.Back().firstPage != rowStart) {
+            continue;
+        }
+
+        while (oldRow < oldRows.size() && oldRows[oldRow].firstPage < rowStart) {
+            ++oldRow;
+        }
+        if (oldRow == oldRows.size() || oldRows[oldRow].firstPage != rowStart || !isFlowRowValid(oldRows[oldRow])) {
+            continue;
+        }
+
+        // Breaks realigned: old rows are kept as long as they stay valid, only moved vertically
+        const float delta = rows.Back().top - oldRows[oldRow].top;
+        rows.PopBack();
+        do {
+            auto row = oldRows[oldRow++];
+            row.top += delta;
+            row.bottom += delta;
+            row.runningWidth = std::max(rows.Empty() ? 0.f : rows.Back().runningWidth, row.width);
+            rows.PushBack(row);
+        } while (oldRow < oldRows.size() && isFlowRowValid(oldRows[oldRow]));
+
+        // The first page of the kept rows is placed already
+        const size_t end = oldRow < oldRows.size() ? oldRows[oldRow].firstPage : layout.GetPagesCount();
+        for (auto coordinates : {&layout.textRects.top, &layout.textRects.bottom, &layout.pageRects.top, &layout.pageRects.bottom}) {
+            for (size_t j = i; j < end; ++j) {
+                coordinates->Mutable(j) += delta;
+            }
+        }
+        restoreFlowContext(rows.Back());
+        i = end;
+    }
+
+    layout.totalSurfaceSize = {
+        layout.alignmentContextValue1 - pagesSpacing,
+        layout.alignmentContextValue2 + layout.alignmentContextValue4 - pagesSpacing
+    };
+}
+
+void CDocumentLayoutEngine::restoreFlowContext(const CDocumentPagesLayout::CRow& lastRow)
+{
+    // Context as it is right after the last page of the row has been placed
+    layout.alignmentContextValue1 = lastRow.runningWidth;
+    layout.alignmentContextValue2 = lastRow.top;
+    layout.alignmentContextValue3 = lastRow.width;
+    layout.alignmentContextValue4 = lastRow.bottom - lastRow.top;
 }
 
-CDocumentPagesLayout::CPageLayout CDocumentLayoutHelper::createAbsolutePageLayout(
-    const IPage* page, IDWriteTextFormat* format, std::wstring text
-) const
+bool CDocumentLayoutEngine::isFlowRowValid(const CDocumentPagesLayout::CRow& row) const
+{
+    return row.fitWidth <= surfaceWidth && surfaceWidth < row.breakWidth;
+}
+
+CDocumentPagesLayout::CPageLayout CDocumentLayoutEngine::loadPageLayout(size_t index) const
 {
     CDocumentPagesLayout::CPageLayout pageLayout;
+    pageLayout.page = layout.pages[index];
 
-    auto pageSize = page->GetPageSize();
+    // Only sizes are kept, alignment places the rects again
+    auto [pageWidth, pageHeight] = layout.pageSizes[index];
+    auto [textWidth, textHeight] = WxH(layout.textRects[index]);
+    pageLayout.textRect = {0.f, 0.f, textWidth, textHeight};
+    pageLayout.pageRect = {0.f, textHeight, (float)pageWidth, textHeight + (float)pageHeight};
+    return pageLayout;
+}
 
-    float textWidth = 0.f;
-    float textHeight = 0.f;
-    std::tie(pageLayout.textLayout.ptr, textWidth, textHeight) = [](IDWriteTextFormat* textFormat, const std::wstring& text, float maxWidth)
-    {
-        IDWriteTextLayout* output = nullptr;
-        OK(DirectWriteFactory()->CreateTextLayout(text.c_str(), text.length(), textFormat, maxWidth, 0.0f, &output));
+void CDocumentLayoutEngine::storePageLayout(size_t index, const CDocumentPagesLayout::CPageLayout& pageLayout)
+{
+    layout.textRects.Set(index, pageLayout.textRect);
+    layout.pageRects.Set(index, pageLayout.pageRect);
+}
 
-        DWRITE_TEXT_METRICS textMetrics;
-        OK(output->GetMetrics(&textMetrics));
-        return std::make_tuple(
-            output, textMetrics.widthIncludingTrailingWhitespace, textMetrics.height * 11.f / 10.f
-        );
-    }(format, text, pageSize.cx);
+CDocumentPagesLayout::CPageLayout CDocumentLayoutEngine::createAbsolutePageLayout(const CPageInfo& pageInfo)
+{
+    CDocumentPagesLayout::CPageLayout pageLayout;
+
+    const auto& pageSize = pageInfo.size;
+
+    // Only the size of the header is needed for layout, its text layout is created when the page is drawn
+    const auto [textWidth, textHeight] = textMeasurer->Measure(pageInfo.headerFont, pageInfo.headerText, pageSize.cx);
 
     pageLayout.textRect = {
         (float)pageMargin,
         (float)pageMargin,
         (float)pageMargin + textWidth,
         pageMargin + textHeight};
-    pageLayout.page = page;
+    pageLayout.page = pageInfo.page;
 
     pageLayout.pageRect = {
         pageLayout.textRect.left,
@@ -256,7 +1219,7 @@ CDocumentPagesLayout::CPageLayout CDocumentLayoutHelper::createAbsolutePageLayou
     return pageLayout;
 }
 
-void CDocumentLayoutHelper::adjustLayoutForCurrentAlignment(CDocumentPagesLayout::CPageLayout& absoluteLayout)
+void CDocumentLayoutEngine::adjustLayoutForCurrentAlignment(CDocumentPagesLayout::CPageLayout& absoluteLayout, size_t index)
 {
     auto& retval = layout;
     switch (strategy)
@@ -269,75 +1232,38 @@ void CDocumentLayoutHelper::adjustLayoutForCurrentAlignment(CDocumentPagesLayout
         adjustPage(absoluteLayout, topOffset, 0.f);
         DEBUG_VAR(absoluteLayout.pageRect);
 
-        auto pageSize = absoluteLayout.page->GetPageSize();
+        auto pageSize = layout.pageSizes[index];
         auto textHeight = Height(absoluteLayout.textRect);
 #undef max
         maxWidth = std::max(maxWidth, (float)pageSize.cx + pageMargin * 2);
+        const float rowTop = topOffset;
         topOffset += pageSize.cy + pageMargin * 2 + textHeight;
+        retval.rows.PushBack({index, rowTop, topOffset, maxWidth});
         topOffset += pagesSpacing;
         
         retval.totalSurfaceSize = {maxWidth, topOffset - pagesSpacing};
         break;
     }
     case TImagesViewAlignment::AlignRight:
-    {
-        float oldMaxPageWidth = retval.alignmentContextValue1;
-        float& maxPageWidth = retval.alignmentContextValue1;
-        float& topOffset = retval.alignmentContextValue2;
-
-        maxPageWidth = std::max(maxPageWidth, Width(absoluteLayout.pageRect));
-        if (maxPageWidth != oldMaxPageWidth) {
-            for (auto& pageLayout : retval.pageRects) {
-                auto [pageWidth, _] = pageLayout.page->GetPageSize();
-                auto textWidth = Width(pageLayout.textRect);
-                pageLayout.textRect.left = pageMargin;
-                pageLayout.textRect.right = pageMargin + textWidth;
-                pageLayout.pageRect.left = pageMargin;
-                pageLayout.pageRect.right = pageMargin + pageWidth;
-                adjustPage(pageLayout, 0, maxPageWidth);
-            }
-        }
-
-        adjustPage(absoluteLayout, topOffset, maxPageWidth);
-
-        auto pageHeight = Height(absoluteLayout.pageRect);
-        auto textHeight = Height(absoluteLayout.textRect);
-
-        topOffset += pageHeight + pageMargin * 2 + textHeight;
-        topOffset += pagesSpacing;
-
-        retval.totalSurfaceSize = {maxPageWidth + pageMargin * 2, topOffset - pagesSpacing};
-        break;
-    }
     case TImagesViewAlignment::AlignHCenter:
     {
-        float oldMaxPageWidth = retval.alignmentContextValue1;
         float& maxPageWidth = retval.alignmentContextValue1;
         float& topOffset = retval.alignmentContextValue2;
 
+        // Pages are placed relative to the column anchor, so a wider page only moves the anchor
         maxPageWidth = std::max(maxPageWidth, Width(absoluteLayout.pageRect));
-        if (maxPageWidth != oldMaxPageWidth) {
-            for (auto& pageLayout : retval.pageRects) {
-                auto [pageWidth, _] = pageLayout.page->GetPageSize();
-                auto textWidth = Width(pageLayout.textRect);
-                pageLayout.textRect.left = pageMargin;
-                pageLayout.textRect.right = pageMargin + textWidth;
-                pageLayout.pageRect.left = pageMargin;
-                pageLayout.pageRect.right = pageMargin + pageWidth;
-                adjustPage(pageLayout, 0, maxPageWidth / 2 - Width(pageLayout.pageRect) / 2);
-            }
-        }
+        adjustPage(absoluteLayout, topOffset, 0.f);
 
-        auto pageWidth = Width(absoluteLayout.pageRect);
         auto pageHeight = Height(absoluteLayout.pageRect);
-        adjustPage(absoluteLayout, topOffset, maxPageWidth / 2 - pageWidth / 2);
-        
         auto textHeight = Height(absoluteLayout.textRect);
 
+        const float rowTop = topOffset;
         topOffset += pageHeight + pageMargin * 2 + textHeight;
+        retval.rows.PushBack({index, rowTop, topOffset, maxPageWidth});
         topOffset += pagesSpacing;
 
         retval.totalSurfaceSize = {maxPageWidth + pageMargin * 2, topOffset - pagesSpacing};
+        retval.columnOffset = columnAnchor(maxPageWidth);
         break;
     }
     case TImagesViewAlignment::HorizontalFlow:
@@ -348,12 +1274,13 @@ void CDocumentLayoutHelper::adjustLayoutForCurrentAlignment(CDocumentPagesLayout
         float& leftOffset = retval.alignmentContextValue3;
         float& maxHeight = retval.alignmentContextValue4;
 
-        const D2D1_SIZE_F drawSurfaceSize{renderTargetSize.width / this->zoom, renderTargetSize.height / this->zoom};
 
         auto [textWidth, textHeight] = WxH(absoluteLayout.textRect);
         auto [pageWidth, pageHeight] = WxH(absoluteLayout.pageRect);
         
-        if (leftOffset != 0.0 && (pageWidth + leftOffset + pageMargin * 2 > drawSurfaceSize.width)) {
+        const float requiredWidth = pageWidth + leftOffset + pageMargin * 2;
+        if (leftOffset != 0.0 && (requiredWidth > surfaceWidth)) {
+            retval.rows.MutableBack().breakWidth = requiredWidth;
             totalLeftOffset = std::max(totalLeftOffset, leftOffset);
             leftOffset = 0.0;
 
@@ -361,14 +1288,23 @@ void CDocumentLayoutHelper::adjustLayoutForCurrentAlignment(CDocumentPagesLayout
             topOffset += pagesSpacing;
             maxHeight = 0.0;
         }
+
+        if (leftOffset == 0.0) {
+            retval.rows.PushBack({index, topOffset, topOffset});
+        } else {
+            retval.rows.MutableBack().fitWidth = requiredWidth;
+        }
         
         adjustPage(absoluteLayout, topOffset, leftOffset);
 
         maxHeight = std::max(maxHeight, (float)pageHeight + pageMargin * 2 + textHeight);
+        retval.rows.MutableBack().bottom = topOffset + maxHeight;
         leftOffset += pageWidth + pageMargin * 2;
         leftOffset += pagesSpacing;
 
         totalLeftOffset = std::max(totalLeftOffset, leftOffset);
+        retval.rows.MutableBack().width = leftOffset;
+        retval.rows.MutableBack().runningWidth = totalLeftOffset;
         retval.totalSurfaceSize = {totalLeftOffset - pagesSpacing, topOffset + maxHeight - pagesSpacing};
         break;
     }
@@ -377,17 +1313,18 @@ void CDocumentLayoutHelper::adjustLayoutForCurrentAlignment(CDocumentPagesLayout
     }
 }
 
-void CDocumentLayoutHelper::adjustPage(CDocumentPagesLayout::CPageLayout& absoluteLayout, float topOffset, float leftOffset) const
+void CDocumentLayoutEngine::adjustPage(CDocumentPagesLayout::CPageLayout& absoluteLayout, float topOffset, float leftOffset) const
 {
     switch(strategy)
     {
         case TImagesViewAlignment::AlignRight:
         {
+            // Right edge of the page is anchored at leftOffset
             auto textWidth = Width(absoluteLayout.textRect);
             auto pageWidth = Width(absoluteLayout.pageRect);
 
-            absoluteLayout.pageRect.left += leftOffset - pageWidth;
-            absoluteLayout.pageRect.right += leftOffset - pageWidth;
+            absoluteLayout.pageRect.left = leftOffset - pageWidth;
+            absoluteLayout.pageRect.right = leftOffset;
             absoluteLayout.pageRect.top += topOffset;
             absoluteLayout.pageRect.bottom += topOffset;
 
@@ -399,8 +1336,25 @@ void CDocumentLayoutHelper::adjustPage(CDocumentPagesLayout::CPageLayout& absolu
 
             break;
         }
-        case TImagesViewAlignment::AlignLeft:
         case TImagesViewAlignment::AlignHCenter:
+        {
+            // Center of the page is anchored at leftOffset, the text starts where the page does
+            auto textWidth = Width(absoluteLayout.textRect);
+            auto pageWidth = Width(absoluteLayout.pageRect);
+
+            absoluteLayout.pageRect.left = leftOffset - pageWidth / 2;
+            absoluteLayout.pageRect.right = leftOffset + pageWidth / 2;
+            absoluteLayout.pageRect.top += topOffset;
+            absoluteLayout.pageRect.bottom += topOffset;
+
+            absoluteLayout.textRect.left = absoluteLayout.pageRect.left;
+            absoluteLayout.textRect.right = absoluteLayout.pageRect.left + textWidth;
+            absoluteLayout.textRect.top += topOffset;
+            absoluteLayout.textRect.bottom += topOffset;
+
+            break;
+        }
+        case TImagesViewAlignment::AlignLeft:
         case TImagesViewAlignment::HorizontalFlow:
         {
             absoluteLayout.textRect.left += leftOffset;
@@ -418,27 +1372,41 @@ void CDocumentLayoutHelper::adjustPage(CDocumentPagesLayout::CPageLayout& absolu
     }
 }
 
+float CDocumentLayoutEngine::columnAnchor(float maxPageWidth) const
+{
+    switch (strategy)
+    {
+    case TImagesViewAlignment::AlignRight:
+        return pageMargin + maxPageWidth;
+    case TImagesViewAlignment::AlignHCenter:
+        return pageMargin + maxPageWidth / 2;
+    default:
+        return 0.f;
+    }
+}
+
 void CDocumentLayoutHelper::calcScrollBars()
 {
-    if(layout.totalSurfaceSize.height == 0.f && layout.totalSurfaceSize.width == 0.f) {
+    if(layout->totalSurfaceSize.height == 0.f && layout->totalSurfaceSize.width == 0.f) {
+        relativeScrollRects = CScrollBarRects{};
         return;
     }
     this->zoom = std::max(this->zoom, 0.1f);
-    const float vVisibleToTotal = this->renderTargetSize.height / (layout.totalSurfaceSize.height * this->zoom);
+    const float vVisibleToTotal = this->renderTargetSize.height / (layout->totalSurfaceSize.height * this->zoom);
     DEBUG_VAR(vVisibleToTotal)
     DEBUG_VAR(vScroll)
 #undef min
     vScroll = std::clamp(vScroll, std::min(-1.0f + vVisibleToTotal, 0.f), 0.0f);
     DEBUG_VAR(vScroll)
-    const float hVisibleToTotal = this->renderTargetSize.width / (layout.totalSurfaceSize.width * this->zoom);
+    const float hVisibleToTotal = this->renderTargetSize.width / (layout->totalSurfaceSize.width * this->zoom);
     DEBUG_VAR(hVisibleToTotal)
     DEBUG_VAR(hScroll)
     hScroll = std::clamp(hScroll, std::min(-1.0f + hVisibleToTotal, 0.f), 0.0f);
     DEBUG_VAR(hScroll)
 
-    layout.viewportOffset = {
-        layout.totalSurfaceSize.width * this->zoom * this->hScroll,
-        layout.totalSurfaceSize.height * this->zoom * this->vScroll
+    viewportOffset = {
+        layout->totalSurfaceSize.width * this->zoom * this->hScroll,
+        layout->totalSurfaceSize.height * this->zoom * this->vScroll
     };
 
     CScrollBarRects newRects;
@@ -486,4 +1454,185 @@ void CDocumentLayoutHelper::calcScrollBars()
     relativeScrollRects = newRects;
 }
 
-}
\ No newline at end of file
+void CBitmapResidency::Touch(IPage* page, bool isDrawn)
+{
+    if (isDrawn) {
+        ++(page->GetPageBitmap() != nullptr ? counters.hits : counters.misses);
+    }
+    auto iter = entriesByPage.find(page);
+    if (iter != entriesByPage.end()) {
+        entries.splice(entries.begin(), entries, iter->second);
+        return;
+    }
+    entries.push_front(page);
+    entriesByPage[page] = entries.begin();
+}
+
+void CBitmapResidency::EvictIf(const std::function<bool(const IPage*)>& predicate)
+{
+    for (auto iter = entries.begin(); iter != entries.end();) {
+        iter = predicate(*iter) ? evict(iter) : std::next(iter);
+    }
+}
+
+void CBitmapResidency::Trim(size_t pinnedCount)
+{
+    // Bitmaps appear when decoding completes, so the bytes are counted again every time
+    counters.residentBytes = 0;
+    for (auto page : entries) {
+        counters.residentBytes += bytesOf(page);
+    }
+
+    auto iter = entries.end();
+    for (size_t index = entries.size(); index > pinnedCount && counters.residentBytes > budget; --index) {
+        --iter;
+        // Pages that are still loading hold no bitmap yet
+        if (bytesOf(*iter) != 0) {
+            iter = evict(iter);
+        }
+    }
+}
+
+void CBitmapResidency::Forget(const IPage* page)
+{
+    auto iter = entriesByPage.find(page);
+    if (iter != entriesByPage.end()) {
+        counters.residentBytes -= std::min(counters.residentBytes, bytesOf(page));
+        entries.erase(iter->second);
+        entriesByPage.erase(iter);
+    }
+}
+
+void CBitmapResidency::Clear()
+{
+    entriesByPage.clear();
+    entries.clear();
+    counters.residentBytes = 0;
+}
+
+size_t CBitmapResidency::bytesOf(const IPage* page)
+{
+    auto bitmap = page->GetPageBitmap();
+    if (bitmap == nullptr) {
+        return 0;
+    }
+    const auto pixelSize = bitmap->GetPixelSize();
+    // Pages are decoded as 32bpp
+    return size_t(pixelSize.width) * pixelSize.height * 4;
+}
+
+std::list<IPage*>::iterator CBitmapResidency::evict(std::list<IPage*>::iterator entry)
+{
+    const size_t bytes = bytesOf(*entry);
+    if (bytes != 0) {
+        ++counters.evictions;
+        counters.residentBytes -= std::min(counters.residentBytes, bytes);
+    }
+    (*entry)->ReleaseBitmap();
+    entriesByPage.erase(*entry);
+    return entries.erase(entry);
+}
+
+void CDecodeScheduler::Schedule(const CDocumentLayoutHelper& helper, ID2D1RenderTarget* renderTarget)
+{
+    // Pages are prefetched for this much time of scrolling at the current speed, but for at least
+    // half and at most four viewport heights
+    constexpr float prefetchSeconds = 0.5f;
+    constexpr float minPrefetch = 0.5f;
+    constexpr float maxPrefetch = 4.f;
+
+    if (renderTarget != target) {
+        // Bitmaps of the previous target are released by the model
+        residency.Clear();
+        target = renderTarget;
+    }
+
+    const auto& pages = helper.GetLayout().pages;
+    const auto viewport = helper.GetViewportRect();
+    const float viewportHeight = std::max(viewport.bottom - viewport.top, 1.f);
+    const float velocity = helper.GetVScrollVelocity();
+    const float ahead = viewportHeight * std::clamp(std::abs(velocity) * prefetchSeconds / viewportHeight, minPrefetch, maxPrefetch);
+    const float behind = viewportHeight * minPrefetch;
+    const bool isScrollingDown = velocity >= 0.f;
+    const float above = isScrollingDown ? behind : ahead;
+    const float below = isScrollingDown ? ahead : behind;
+
+    const auto [firstVisible, lastVisible] = helper.QueryVisible(viewport);
+    const auto [firstWanted, lastWanted] = helper.QueryVisible(
+        {viewport.left, viewport.top - above, viewport.right, viewport.bottom + below});
+    // Bitmaps of the pages a bit further keep living, so scrolling back and forth doesn't decode them again
+    const auto [firstKept, lastKept] = helper.QueryVisible(
+        {viewport.left, viewport.top - above - viewportHeight, viewport.right, viewport.bottom + below + viewportHeight});
+
+    // Pages are drawn with this many target pixels per page pixel, they may decode smaller levels of detail for it
+    float dpiX = 96.f;
+    float dpiY = 96.f;
+    if (target != nullptr) {
+        target->GetDpi(&dpiX, &dpiY);
+    }
+    const float scale = helper.GetZoom() * dpiX / 96.f;
+    // A level of detail is less than twice as large as the drawn page on each side
+    const float bytesPerPixel = 4.f * std::pow(std::min(2.f * scale, 1.f), 2.f);
+
+    // Visible pages go first, then the nearest pages in the direction of scrolling, then the ones behind.
+    // Prefetching stops when the wanted bitmaps would not fit into the budget, visible pages are always wanted.
+    size_t wantedBytes = 0;
+    auto addWanted = [&](const IPage* page) {
+        const SIZE size = page->GetPageSize();
+        wantedBytes += size_t(float(std::max(size.cx, 0L)) * float(std::max(size.cy, 0L)) * bytesPerPixel);
+        wantedPages.push_back(page);
+    };
+    wantedPages.clear();
+    for (size_t i = firstVisible; i < lastVisible; ++i) {
+        addWanted(pages[i]);
+    }
+    auto addBelow = [&] {
+        for (size_t i = std::max(lastVisible, firstWanted); i < lastWanted && wantedBytes < residency.GetBudget(); ++i) {
+            addWanted(pages[i]);
+        }
+    };
+    auto addAbove = [&] {
+        for (size_t i = std::min(firstVisible, lastWanted); i > firstWanted && wantedBytes < residency.GetBudget(); --i) {
+            addWanted(pages[i - 1]);
+        }
+    };
+    if (isScrollingDown) {
+        addBelow();
+        addAbove();
+    } else {
+        addAbove();
+        addBelow();
+    }
+    // Pages submit their decoding with themselves as the owner
+    CDecodeWorkerPool::Instance().SetPriorities(wantedPages);
+
+    // Wanted pages are touched from the least to the most urgent one, so the visible ones are used the most recently
+    const size_t visibleCount = lastVisible - firstVisible;
+    for (size_t i = wantedPages.size(); i > 0; --i) {
+        auto page = const_cast<IPage*>(static_cast<const IPage*>(wantedPages[i - 1]));
+        residency.Touch(page, i - 1 < visibleCount);
+        page->PrepareBitmapForTarget(target, scale);
+    }
+
+    // Decoded memory follows the viewport, not the size of the collection
+    keptPages.clear();
+    keptPages.insert(pages.begin() + firstKept, pages.begin() + lastKept);
+    residency.EvictIf([this](const IPage* page) {
+        return keptPages.count(page) == 0;
+    });
+    residency.Trim(wantedPages.size());
+}
+
+void CDecodeScheduler::Forget(const std::vector<const IPage*>& pages)
+{
+    for (auto page : pages) {
+        residency.Forget(page);
+    }
+}
+
+void CDecodeScheduler::Clear()
+{
+    residency.Clear();
+}
+
+}
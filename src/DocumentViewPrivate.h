@@ -9,12 +9,29 @@
 #include <d2d1helper.h>
 #include <dwrite.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
+struct CPageInfo;
 struct IDocumentsModel;
 struct IPage;
 
@@ -25,38 +42,511 @@ bool operator==(const D2D1_RECT_F& lhs, const D2D1_RECT_F& rhs);
 bool operator!=(const D2D1_RECT_F& lhs, const D2D1_RECT_F& rhs);
 
 namespace DocumentViewPrivate {
-/// @brief Resulting layout
+/// @brief Array kept in fixed size chunks that layout snapshots share.
+/// Copying it copies only the chunk pointers. A chunk is cloned when it is written while a copy still refers to it,
+/// so publishing a layout costs the chunks changed since the previous one rather than the whole layout.
+template<typename T>
+class CChunkedArray {
+public:
+    /// Elements per chunk, all chunks but the last one are full
+    static constexpr size_t ChunkSize = 4096;
+
+    /// @brief Random access iterator over the elements, read only
+    class CConstIterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        CConstIterator() = default;
+        CConstIterator(const CChunkedArray* array, size_t index) : array{array}, index{index} {}
+
+        reference operator*() const { return (*array)[index]; }
+        pointer operator->() const { return &(*array)[index]; }
+        reference operator[](difference_type offset) const { return (*array)[index + offset]; }
+
+        CConstIterator& operator++() { ++index; return *this; }
+        CConstIterator operator++(int) { auto result = *this; ++index; return result; }
+        CConstIterator& operator--() { --index; return *this; }
+        CConstIterator operator--(int) { auto result = *this; --index; return result; }
+        CConstIterator& operator+=(difference_type offset) { index += offset; return *this; }
+        CConstIterator& operator-=(difference_type offset) { index -= offset; return *this; }
+
+        friend CConstIterator operator+(CConstIterator iter, difference_type offset) { return iter += offset; }
+        friend CConstIterator operator+(difference_type offset, CConstIterator iter) { return iter += offset; }
+        friend CConstIterator operator-(CConstIterator iter, difference_type offset) { return iter -= offset; }
+        friend difference_type operator-(const CConstIterator& lhs, const CConstIterator& rhs)
+        {
+            return difference_type(lhs.index) - difference_type(rhs.index);
+        }
+
+        friend bool operator==(const CConstIterator& lhs, const CConstIterator& rhs) { return lhs.index == rhs.index; }
+        friend bool operator!=(const CConstIterator& lhs, const CConstIterator& rhs) { return lhs.index != rhs.index; }
+        friend bool operator<(const CConstIterator& lhs, const CConstIterator& rhs) { return lhs.index < rhs.index; }
+        friend bool operator>(const CConstIterator& lhs, const CConstIterator& rhs) { return lhs.index > rhs.index; }
+        friend bool operator<=(const CConstIterator& lhs, const CConstIterator& rhs) { return lhs.index <= rhs.index; }
+        friend bool operator>=(const CConstIterator& lhs, const CConstIterator& rhs) { return lhs.index >= rhs.index; }
+
+    private:
+        const CChunkedArray* array = nullptr;
+        size_t index = 0;
+    };
+
+    /// @return Index past the last element of the chunk that holds index
+    static size_t ChunkEnd(size_t index) { return (index / ChunkSize + 1) * ChunkSize; }
+
+    size_t Size() const { return size; }
+    bool Empty() const { return size == 0; }
+
+    const T& operator[](size_t index) const { return (*chunks[index / ChunkSize])[index % ChunkSize]; }
+    const T& Back() const { return (*this)[size - 1]; }
+    /// @brief Elements from index to the end of its chunk are contiguous, see ChunkEnd
+    const T* Data(size_t index) const { return chunks[index / ChunkSize]->data() + index % ChunkSize; }
+
+    CConstIterator begin() const { return {this, 0}; }
+    CConstIterator end() const { return {this, size}; }
+
+    /// @brief Get an element to change, its chunk is cloned if it is shared
+    T& Mutable(size_t index) { return mutableChunk(index / ChunkSize)[index % ChunkSize]; }
+    T& MutableBack() { return Mutable(size - 1); }
+    void Set(size_t index, const T& value) { Mutable(index) = value; }
+
+    void PushBack(const T& value)
+    {
+        if (size % ChunkSize == 0) {
+            chunks.push_back(std::make_shared<CChunk>());
+        }
+        mutableChunk(chunks.size() - 1).push_back(value);
+        ++size;
+    }
+
+    void PopBack() { Resize(size - 1); }
+
+    void Resize(size_t newSize, const T& value = T{})
+    {
+        const size_t chunksCount = (newSize + ChunkSize - 1) / ChunkSize;
+        chunks.resize((std::min)(chunks.size(), chunksCount));
+        // Only the last chunk may be partial
+        if (!chunks.empty()) {
+            const size_t lastSize = (std::min)(ChunkSize, newSize - (chunks.size() - 1) * ChunkSize);
+            if (chunks.back()->size() != lastSize) {
+                mutableChunk(chunks.size() - 1).resize(lastSize, value);
+            }
+        }
+        while (chunks.size() < chunksCount) {
+            chunks.push_back(std::make_shared<CChunk>((std::min)(ChunkSize, newSize - chunks.size() * ChunkSize), value));
+        }
+        size = newSize;
+    }
+
+    void Clear()
+    {
+        chunks.clear();
+        size = 0;
+    }
+
+    /// @brief Insert count copies of value before index
+    void Insert(size_t index, size_t count, const T& value)
+    {
+        const size_t oldSize = size;
+        Resize(size + count, value);
+        for (size_t i = oldSize; i-- > index;) {
+            Set(i + count, (*this)[i]);
+        }
+        for (size_t i = index; i < (std::min)(index + count, oldSize); ++i) {
+            Set(i, value);
+        }
+    }
+
+    /// @brief Erase elements [first, last)
+    void Erase(size_t first, size_t last)
+    {
+        for (size_t i = last; i < size; ++i) {
+            Set(first + i - last, (*this)[i]);
+        }
+        Resize(size - (last - first));
+    }
+
+    /// @brief Clone the shared chunks that hold [first, last), so their elements can be set from several threads
+    void MakeUnique(size_t first, size_t last)
+    {
+        for (size_t chunk = first / ChunkSize; chunk * ChunkSize < last; ++chunk) {
+            mutableChunk(chunk);
+        }
+    }
+
+private:
+    using CChunk = std::vector<T>;
+
+    std::vector<std::shared_ptr<CChunk>> chunks;
+    size_t size = 0;
+
+    CChunk& mutableChunk(size_t chunkIndex)
+    {
+        auto& chunk = chunks[chunkIndex];
+        if (chunk.use_count() != 1) {
+            chunk = std::make_shared<CChunk>(*chunk);
+        } else {
+            // Snapshots are copied on the layout thread only, other threads can just drop their references.
+            // The drop is a release, so reads of the chunk by the thread that dropped the last copy end before the writes.
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return *chunk;
+    }
+};
+
+/// @brief Rects stored as separate coordinate arrays (structure of arrays).
+/// Culling and hit testing stream only the coordinates they compare.
+struct CRectArray {
+    static constexpr size_t ChunkSize = CChunkedArray<float>::ChunkSize;
+
+    CChunkedArray<float> left;
+    CChunkedArray<float> top;
+    CChunkedArray<float> right;
+    CChunkedArray<float> bottom;
+
+    size_t Size() const { return left.Size(); }
+
+    D2D1_RECT_F operator[](size_t index) const
+    {
+        return {left[index], top[index], right[index], bottom[index]};
+    }
+
+    void Set(size_t index, const D2D1_RECT_F& rect)
+    {
+        left.Set(index, rect.left);
+        top.Set(index, rect.top);
+        right.Set(index, rect.right);
+        bottom.Set(index, rect.bottom);
+    }
+
+    void PushBack(const D2D1_RECT_F& rect)
+    {
+        left.PushBack(rect.left);
+        top.PushBack(rect.top);
+        right.PushBack(rect.right);
+        bottom.PushBack(rect.bottom);
+    }
+
+    /// @brief Make room for count rects before index, their values are unspecified
+    void Insert(size_t index, size_t count)
+    {
+        for (auto coordinates : {&left, &top, &right, &bottom}) {
+            coordinates->Insert(index, count, 0.f);
+        }
+    }
+
+    void Erase(size_t index)
+    {
+        for (auto coordinates : {&left, &top, &right, &bottom}) {
+            coordinates->Erase(index, index + 1);
+        }
+    }
+
+    void Resize(size_t size)
+    {
+        for (auto coordinates : {&left, &top, &right, &bottom}) {
+            coordinates->Resize(size);
+        }
+    }
+
+    /// @copydoc CChunkedArray::MakeUnique
+    void MakeUnique(size_t first, size_t last)
+    {
+        for (auto coordinates : {&left, &top, &right, &bottom}) {
+            coordinates->MakeUnique(first, last);
+        }
+    }
+};
+
+/// @brief Bit per tested rect, set if the rect intersects the viewport
+struct CVisibilityMask {
+    std::vector<uint64_t> bits;
+
+    bool IsVisible(size_t index) const
+    {
+        return (bits[index / 64] >> (index % 64)) & 1u;
+    }
+};
+
+/// @brief Test rects [first, last) against the viewport, several rects per SIMD instruction
+/// @param rects Rects to test
+/// @param first Index of the first rect to test
+/// @param last Index past the last rect to test
+/// @param viewPortRect Viewport in the coordinates of the rects
+/// @param mask Output, bit i corresponds to rect first + i
+void CullRects(const CRectArray& rects, size_t first, size_t last, const D2D1_RECT_F& viewPortRect, CVisibilityMask& mask);
+
+/// @brief Resulting layout. Published layouts are immutable snapshots shared with the UI thread,
+/// they share the chunks of their arrays with each other and with the layout being computed.
 struct CDocumentPagesLayout {
     D2D1_SIZE_F totalSurfaceSize = {0.0f, 0.0f};
-    D2D1_SIZE_F viewportOffset = {0.0f, 0.0f};
+    /// Horizontal offset of page rects on the surface. Right and center alignments keep rects
+    /// relative to the column anchor, so the widest page moves the anchor instead of every page.
+    float columnOffset = 0.f;
+
+    /// @brief Layout of a single page while it is being placed
     struct CPageLayout {
-        CComPtr<IDWriteTextLayout> textLayout = nullptr;
         D2D1_RECT_F textRect;
 
         const IPage* page = nullptr;
         D2D1_RECT_F pageRect;
     };
-    std::vector<CPageLayout> pageRects;
+
+    // Pages in structure-of-arrays form, all indexed by page index.
+    // Header text layouts are not kept here, see CDocumentLayoutHelper::GetHeaderLayout.
+    CChunkedArray<const IPage*> pages;
+    /// Page sizes as they were when the pages were inserted, the layout never asks pages for them
+    CChunkedArray<SIZE> pageSizes;
+    /// Model-owned header texts
+    CChunkedArray<std::wstring_view> headerTexts;
+    CChunkedArray<IDWriteTextFormat*> headerFormats;
+    CRectArray textRects;
+    CRectArray pageRects;
+
+    size_t GetPagesCount() const { return pages.Size(); }
+
+    /// Number of layout requests this layout reflects
+    uint64_t generation = 0;
 
 private:
     /// Offsets or other values that allow to modify existing layout
+    friend class CDocumentLayoutEngine;
     friend class CDocumentLayoutHelper;
+
+    /// @brief Horizontal band of the surface occupied by consecutive pages.
+    /// Vertical alignments have a row per page, horizontal flow packs several pages into a row.
+    /// Rows are sorted by both top and bottom, so the visible ones are found by binary search.
+    struct CRow {
+        size_t firstPage = 0;
+        float top = 0.f;
+        float bottom = 0.f;
+        /// Running surface width of the alignment after this row, lets the layout resume from the next one
+        float runningWidth = 0.f;
+
+        // Horizontal flow only. Row breaks stay the same while fitWidth <= surface width < breakWidth.
+        /// Width of the row pages including the trailing spacing
+        float width = 0.f;
+        /// Smallest surface width that keeps all pages of the row in it
+        float fitWidth = 0.f;
+        /// Smallest surface width that would pull the first page of the next row into this one
+        float breakWidth = std::numeric_limits<float>::infinity();
+    };
+    CChunkedArray<CRow> rows;
+
     float alignmentContextValue1 = 0.f;
     float alignmentContextValue2 = 0.f;
     float alignmentContextValue3 = 0.f;
     float alignmentContextValue4 = 0.f;
 };
 
+/// @brief Header text measuring used by the layout engine on the layout thread
+struct ITextMeasurer {
+    virtual ~ITextMeasurer() = default;
+
+    /// @brief Estimate the size a text layout of this text would have
+    /// @param format Format of the text
+    /// @param text Text to measure
+    /// @param maxWidth Width the text wraps at
+    /// @return Width including trailing whitespace and height of all lines
+    virtual D2D1_SIZE_F Measure(IDWriteTextFormat* format, std::wstring_view text, float maxWidth) = 0;
+};
+
+/// @brief Measures header text from font metrics, without creating a text layout.
+/// Line height and glyph advances are read from the font face once and cached per format,
+/// single line sizes are cached per format and text.
+class CDirectWriteTextMeasurer : public ITextMeasurer {
+public:
+    /// @copydoc ITextMeasurer::Measure
+    D2D1_SIZE_F Measure(IDWriteTextFormat* format, std::wstring_view text, float maxWidth) override;
+
+private:
+    struct CFontMetrics {
+        /// Keeps the format alive, so its address is not reused by another one
+        CComPtr<IDWriteTextFormat> format;
+        /// Null if the font could not be resolved, text of such format is measured with a text layout
+        CComPtr<IDWriteFontFace> fontFace;
+        float designUnitsToDips = 0.f;
+        float lineHeight = 0.f;
+        std::unordered_map<uint32_t, float> advances;
+        /// All digits have the same advance, so texts that differ in digits only have the same size
+        bool hasTabularDigits = false;
+        /// Single line sizes of measured texts. With tabular digits, the digits of a key are zeros.
+        std::unordered_map<std::wstring, D2D1_SIZE_F> lineSizes;
+    };
+    std::unordered_map<IDWriteTextFormat*, CFontMetrics> fonts;
+    /// Buffer of the line size key, reused between measurings
+    std::wstring key;
+
+    CFontMetrics& metricsOf(IDWriteTextFormat* format);
+    float advanceOf(CFontMetrics& metrics, uint32_t codePoint);
+};
+
+/// @brief Measures text as if every character had the same advance, fonts are not touched.
+/// Makes layout cost independent of font shaping.
+class CFixedTextMeasurer : public ITextMeasurer {
+public:
+    /// @param characterWidth Advance of every character
+    /// @param lineHeight Height of a line
+    CFixedTextMeasurer(float characterWidth, float lineHeight) : characterWidth{characterWidth}, lineHeight{lineHeight} {}
+
+    /// @copydoc ITextMeasurer::Measure
+    D2D1_SIZE_F Measure(IDWriteTextFormat* format, std::wstring_view text, float maxWidth) override;
+
+private:
+    float characterWidth;
+    float lineHeight;
+};
+
+/// @brief Text layouts of recently drawn headers, the least recently used one is released first
+class CHeaderLayoutCache {
+public:
+    explicit CHeaderLayoutCache(size_t capacity) : capacity{capacity} {}
+
+    /// @return Cached layout of the page header, nullptr if there is none
+    IDWriteTextLayout* Find(const IPage* page);
+    /// @brief Cache the layout, evicting the least recently used one if the cache is full
+    IDWriteTextLayout* Insert(const IPage* page, CComPtr<IDWriteTextLayout> textLayout);
+    void Erase(const IPage* page);
+    void Clear();
+    /// @brief Change how many layouts are kept, the least recently used ones over it are released
+    void SetCapacity(size_t capacity);
+
+private:
+    using CEntry = std::pair<const IPage*, CComPtr<IDWriteTextLayout>>;
+
+    size_t capacity;
+    /// Most recently used entries first
+    std::list<CEntry> entries;
+    std::unordered_map<const IPage*, std::list<CEntry>::iterator> entriesByPage;
+};
+
 /// @brief Where to draw scrolls
 struct CScrollBarRects {
     std::optional<D2D1_ROUNDED_RECT> hScrollBar;
     std::optional<D2D1_ROUNDED_RECT> vScrollBar;
 };
 
+/// @brief Scroll speed averaged over the recent scroll events, fades out when scrolling stops
+class CScrollVelocity {
+public:
+    /// @param distance Scrolled distance in surface units, positive is down
+    void Add(float distance);
+    /// @return Surface units per second, positive is down
+    float Get() const;
+
+private:
+    using CClock = std::chrono::steady_clock;
+
+    float velocity = 0.f;
+    CClock::time_point lastScroll;
+};
+
+/// @brief Values the layout depends on, captured on the UI thread with every layout request
+struct CLayoutParameters {
+    /// Width available to horizontal flow, render target width divided by zoom
+    float surfaceWidth = 0.f;
+    int pageMargin = 0;
+    int pagesSpacing = 0;
+    TImagesViewAlignment strategy = TImagesViewAlignment::AlignLeft;
+};
+
+/// @brief Threads that large layouts are split between. They are started on first use
+/// and wait for the next layout in between, so relayouts on zoom and resize don't create threads.
+class CLayoutWorkers {
+public:
+    /// @param chunksCount Number of chunks a job is split into, the calling thread runs one of them
+    explicit CLayoutWorkers(size_t chunksCount = (std::max)(1u, std::thread::hardware_concurrency()));
+    ~CLayoutWorkers();
+
+    CLayoutWorkers(const CLayoutWorkers&) = delete;
+    CLayoutWorkers& operator=(const CLayoutWorkers&) = delete;
+
+    size_t GetChunksCount() const { return chunksCount; }
+
+    /// @brief Run job(chunk) for every chunk in [0, GetChunksCount()) and wait until all of them finish.
+    /// The calling thread runs chunk 0, every thread of the set runs one of the others.
+    void Run(const std::function<void(size_t chunk)>& job);
+
+private:
+    const size_t chunksCount;
+    std::mutex mutex;
+    /// Signals threads about a new job
+    std::condition_variable jobStarted;
+    /// Signals Run about finished chunks
+    std::condition_variable chunkFinished;
+    const std::function<void(size_t)>* job = nullptr;
+    uint64_t jobGeneration = 0;
+    size_t runningChunks = 0;
+    bool isStopping = false;
+    std::vector<std::thread> threads;
+
+    void runThread(size_t chunk);
+};
+
+/// @brief Lays pages out. Runs on the layout thread and touches neither pages nor the model.
+class CDocumentLayoutEngine {
+public:
+    const CDocumentPagesLayout& GetLayout() const { return layout; }
+
+    void SetParameters(const CLayoutParameters& parameters);
+
+    /// @brief Measure headers of all pages with another measurer and lay them out again
+    void SetTextMeasurer(std::shared_ptr<ITextMeasurer> measurer);
+
+    /// @brief Insert pages with a single layout pass.
+    /// Appending lays out only the new pages, inserting in the middle relayouts from the first inserted one.
+    /// @param firstIndex Index of the first inserted page
+    /// @param pageInfos Inserted pages
+    void InsertPages(size_t firstIndex, const std::vector<CPageInfo>& pageInfos);
+    void DeletePage(const std::variant<const IPage*, int>& page);
+    /// @brief Delete a batch of pages with a single relayout that starts at the first deleted page
+    /// @param pages Pages to delete, the ones not in the layout are ignored
+    void DeletePages(const std::vector<const IPage*>& pages);
+    void ClearPages();
+    void RefreshLayout();
+    /// @brief Update horizontal flow for the current surface width.
+    /// Only rows whose breaks change are laid out again, the others are moved vertically.
+    void Reflow();
+
+private:
+    float surfaceWidth = 0.f;
+    int pageMargin = 0;
+    int pagesSpacing = 0;
+    TImagesViewAlignment strategy = TImagesViewAlignment::AlignLeft;
+
+    CDocumentPagesLayout layout;
+    std::shared_ptr<ITextMeasurer> textMeasurer = std::make_shared<CDirectWriteTextMeasurer>();
+    CLayoutWorkers workers;
+
+    CDocumentPagesLayout::CPageLayout createAbsolutePageLayout(const CPageInfo& pageInfo);
+    void adjustLayoutForCurrentAlignment(CDocumentPagesLayout::CPageLayout& absoluteLayout, size_t index);
+    void adjustPage(CDocumentPagesLayout::CPageLayout& absoluteLayout, float topOffset, float leftOffset) const;
+    /// @brief Load page layout as it was before the page got placed by alignment
+    CDocumentPagesLayout::CPageLayout loadPageLayout(size_t index) const;
+    void storePageLayout(size_t index, const CDocumentPagesLayout::CPageLayout& pageLayout);
+    void relayoutFrom(size_t index);
+    void layoutPagesFrom(size_t first);
+    /// @brief Lay out pages of vertical alignments on several threads
+    void layoutVerticalPagesFrom(size_t first);
+    void restoreFlowContext(const CDocumentPagesLayout::CRow& lastRow);
+    bool isFlowRowValid(const CDocumentPagesLayout::CRow& row) const;
+    float columnAnchor(float maxPageWidth) const;
+};
+
+/// @brief Layout of the view. Pages are laid out by CDocumentLayoutEngine on a background thread,
+/// which publishes every finished layout as an immutable snapshot. The UI thread keeps drawing
+/// and hit testing the snapshot it acquired last, scrolls and zoom are applied to it right away.
 class CDocumentLayoutHelper {
 public:
-    CDocumentLayoutHelper() = default;
-    ~CDocumentLayoutHelper() = default;
+    /// @param onLayoutPublished Called on the layout thread when a new snapshot is ready to be acquired
+    explicit CDocumentLayoutHelper(std::function<void()> onLayoutPublished = {});
+    ~CDocumentLayoutHelper();
+
+    CDocumentLayoutHelper(const CDocumentLayoutHelper&) = delete;
+    CDocumentLayoutHelper& operator=(const CDocumentLayoutHelper&) = delete;
 
     D2D1_SIZE_F GetRenderTargetSize() const { return this->renderTargetSize; }
     void SetRenderTargetSize(const D2D1_SIZE_F& renderTargetSize);
@@ -73,6 +563,9 @@ public:
     float GetVScroll() const { return this->vScroll; }
     void SetVScroll(float vScroll);
     void AddVScroll(float delta);
+    /// @brief Speed of recent AddVScroll calls
+    /// @return Surface units per second, positive is down
+    float GetVScrollVelocity() const { return this->vScrollVelocity.Get(); }
 
     float GetHScroll() const { return this->hScroll; }
     void SetHScroll(float hScroll);
@@ -82,15 +575,77 @@ public:
     void SetZoom(float zoom);
     void AddZoom(float delta);
 
+    /// @brief Get the acquired layout snapshot. It does not change until the next AcquireLayout.
     const CDocumentPagesLayout& GetLayout() const;
     const CScrollBarRects& GetRelativeScrollBarRects() const;
+    /// @brief Get the offset of the surface in the render target, in render target coordinates
+    D2D1_SIZE_F GetViewportOffset() const { return this->viewportOffset; }
 
-    void AddPage(const IPage* page, IDWriteTextFormat* format, std::wstring headerText);
-    void DeletePage(const std::variant<const IPage*, int>& page);
-    void ClearPages();
+    /// @brief Switch to the latest published layout snapshot. Never waits for the layout thread.
+    /// @return True if the snapshot changed
+    bool AcquireLayout();
+    /// @brief Check if the acquired snapshot reflects all layout requests made so far
+    bool IsLayoutCurrent() const;
+    /// @brief Wait until the layout thread processes all requests, then acquire the result
+    void WaitForLayout();
+
+    /// @brief Get the part of the surface that is visible in the render target, in page rects coordinates
+    D2D1_RECT_F GetViewportRect() const;
+
+    /// @brief Find pages that may intersect the viewport
+    /// @param viewPortRect Rect in surface coordinates
+    /// @return Range [first, last) of indices in CDocumentPagesLayout::pageRects
+    std::pair<size_t, size_t> QueryVisible(const D2D1_RECT_F& viewPortRect) const;
+
+    /// @brief Find the page under a point of the render target, taking zoom and scrolls into account
+    /// @param x Horizontal client coordinate
+    /// @param y Vertical client coordinate
+    /// @return Index in CDocumentPagesLayout::pageRects, -1 if there is no page at this point
+    int PageAtPoint(float x, float y) const;
+
+    /// @brief Get the text layout to draw the page header with.
+    /// Layouts are created on demand for visible pages and only a bounded number of them is kept.
+    /// @param index Index in CDocumentPagesLayout::pages
+    /// @return Layout that stays valid until the next call
+    IDWriteTextLayout* GetHeaderLayout(size_t index);
+    /// @brief Keep enough header layouts for the visible pages, so they are not recreated on every paint.
+    /// Call it before drawing the headers.
+    /// @param visibleCount Number of pages found by QueryVisible for the viewport
+    void ReserveHeaderLayouts(size_t visibleCount);
+
+    /// @param headerText Header text, must stay valid while the page is in the layout
+    void AddPage(const IPage* page, IDWriteTextFormat* format, std::wstring_view headerText);
+    /// @brief Insert a range of model pages. Page data is read from the model right away,
+    /// the layout is computed in the background.
+    /// @param model Model the pages are taken from, its page indices match the layout ones
+    /// @param firstIndex Index of the first inserted page
+    /// @param count Number of inserted pages
+    void InsertPages(const IDocumentsModel& model, int firstIndex, int count);
+    /// @brief Delete a page. Does not wait for the layout, the page stays referenced until
+    /// a snapshot without it is acquired.
+    /// @param onReleased Called on the UI thread once the page is not referenced anymore,
+    /// it should keep the page alive until then. Dropped without a call if the helper is destroyed first.
+    void DeletePage(const std::variant<const IPage*, int>& page, std::function<void()> onReleased = {});
+    /// @brief Delete a batch of pages, see DeletePage
+    /// @param pages Pages to delete, the ones not in the layout are ignored
+    /// @param onReleased Called once the pages are not referenced anymore
+    void DeletePages(const std::vector<const IPage*>& pages, std::function<void()> onReleased = {});
+    /// @brief Delete all pages. The acquired layout is emptied right away,
+    /// the layout thread may still reference the pages until it publishes the cleared layout.
+    /// @param onReleased Called once the pages are not referenced anymore
+    void ClearPages(std::function<void()> onReleased = {});
     void RefreshLayout();
 
+    /// @brief Set header text measurer. Pages are measured with it on the layout thread from now on.
+    /// @param measurer Measurer, DirectWrite one is used by default
+    void SetTextMeasurer(std::shared_ptr<ITextMeasurer> measurer);
+
 private:
+    using CLayoutJob = std::function<void(CDocumentLayoutEngine&)>;
+
+    /// Header layouts kept even if fewer pages are visible
+    static constexpr size_t MinHeaderLayouts = 256;
+
     D2D1_SIZE_F renderTargetSize{0, 0};
     int pageMargin = 0;
     int pagesSpacing = 0;
@@ -98,16 +653,110 @@ private:
     float vScroll = 0.0f;
     float hScroll = 0.0f;
     float zoom = 1.0f;
+    CScrollVelocity vScrollVelocity;
 
-    CDocumentPagesLayout layout;
+    std::shared_ptr<const CDocumentPagesLayout> layout;
+    D2D1_SIZE_F viewportOffset = {0.0f, 0.0f};
     CScrollBarRects relativeScrollRects;
+    CHeaderLayoutCache headerLayouts{MinHeaderLayouts};
+    /// Generation of the last layout request
+    uint64_t requestedGeneration = 0;
 
-    CDocumentPagesLayout::CPageLayout createAbsolutePageLayout(const IPage* page, IDWriteTextFormat* format, std::wstring text) const;
-    void adjustLayoutForCurrentAlignment(CDocumentPagesLayout::CPageLayout& absoluteLayout);
-    void adjustPage(CDocumentPagesLayout::CPageLayout& absoluteLayout, float topOffset, float leftOffset) const;
+    // Layout thread state. The engine is used by the layout thread only.
+    CDocumentLayoutEngine engine;
+    std::function<void()> onLayoutPublished;
+    std::mutex jobsMutex;
+    std::condition_variable jobsChanged;
+    std::deque<std::pair<uint64_t, CLayoutJob>> jobs;
+    bool isEngineBusy = false;
+    bool isStopping = false;
+    /// Accessed with std::atomic_load and std::atomic_store
+    std::shared_ptr<const CDocumentPagesLayout> publishedLayout;
+    std::thread layoutThread;
+
+    /// @brief Deleted pages that may still be referenced by the layout thread or the acquired snapshot
+    struct CRetiredPages
+    {
+        /// Generation of the delete request
+        uint64_t generation = 0;
+        std::vector<const IPage*> pages;
+        /// The deleted pages are not known, e.g. a page was deleted by index, so all header layouts are dropped
+        bool isUnknownPages = false;
+        std::function<void()> onReleased;
+    };
+    /// Ordered by generation
+    std::deque<CRetiredPages> retiredPages;
+
+    CLayoutParameters parameters() const;
+    void requestLayout(CLayoutJob job);
+    void runLayoutThread();
+    void releaseRetiredPages(uint64_t publishedGeneration);
     void calcScrollBars();
 };
 
+/// @brief Keeps bytes of page bitmaps across all documents within a budget.
+/// The least recently drawn bitmaps are evicted first, the pages load them again when they are drawn.
+class CBitmapResidency {
+public:
+    explicit CBitmapResidency(size_t budget) : budget{budget} {}
+
+    size_t GetBudget() const { return this->budget; }
+    void SetBudget(size_t budget) { this->budget = budget; }
+    const CBitmapResidencyCounters& GetCounters() const { return this->counters; }
+
+    /// @brief Make the page the most recently used one, start tracking it if it is new
+    /// @param isDrawn The page is drawn now, so it is counted as a hit or a miss
+    void Touch(IPage* page, bool isDrawn);
+    /// @brief Release bitmaps of the tracked pages that match the predicate
+    void EvictIf(const std::function<bool(const IPage*)>& predicate);
+    /// @brief Release the least recently used bitmaps until the rest fit into the budget
+    /// @param pinnedCount Number of the most recently used pages that are never evicted
+    void Trim(size_t pinnedCount);
+    /// @brief Stop tracking the page without touching it, e.g. when it is going to be deleted
+    void Forget(const IPage* page);
+    void Clear();
+
+private:
+    size_t budget;
+    CBitmapResidencyCounters counters;
+    /// Most recently used pages first, including the ones that are still loading
+    std::list<IPage*> entries;
+    std::unordered_map<const IPage*, std::list<IPage*>::iterator> entriesByPage;
+
+    static size_t bytesOf(const IPage* page);
+    /// @brief Release the bitmap of the entry and stop tracking it
+    std::list<IPage*>::iterator evict(std::list<IPage*>::iterator entry);
+};
+
+/// @brief Decides which pages have bitmaps. Visible pages are decoded first, then the ones
+/// in the direction of scrolling as long as they fit into the bitmap budget.
+/// The ones far from the viewport and the least recently drawn ones over the budget are released.
+class CDecodeScheduler {
+public:
+    /// @brief Request bitmaps around the viewport of the acquired layout. Called every time the view is drawn.
+    /// @param helper Layout helper of the view
+    /// @param renderTarget Target the pages are drawn to
+    void Schedule(const CDocumentLayoutHelper& helper, ID2D1RenderTarget* renderTarget);
+    /// @brief Forget pages that are going to be deleted
+    void Forget(const std::vector<const IPage*>& pages);
+    /// @brief Forget all pages, e.g. when the model is replaced
+    void Clear();
+
+    /// @brief Bitmaps of the pages requested by the scheduler
+    CBitmapResidency& GetResidency() { return this->residency; }
+
+private:
+    /// Default budget of page bitmaps
+    static constexpr size_t DefaultBitmapBudget = size_t(512) << 20;
+
+    ID2D1RenderTarget* target = nullptr;
+    /// Pages whose bitmaps were requested and not released yet
+    CBitmapResidency residency{DefaultBitmapBudget};
+    // Reused between calls
+    std::vector<const void*> wantedPages;
+    std::unordered_set<const IPage*> keptPages;
+};
+
 }
 
 #endif
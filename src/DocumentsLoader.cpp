@@ -0,0 +1,178 @@
+#include <DocumentsLoader.h>
+
+#include <Defines.h>
+#include <BasicDocumentModel.h>
+#include <DecodeWorkerPool.h>
+#include <DocumentFromDisk.h>
+
+#include <shlwapi.h>
+
+#include <algorithm>
+
+/// @brief Append paths of the directory files to the output, sorted the way Explorer does
+static void ListDirectory(const std::wstring& path, bool isRecursive, std::vector<std::wstring>& output)
+{
+    std::vector<std::wstring> fileNames;
+    std::vector<std::wstring> directoryNames;
+
+    WIN32_FIND_DATAW findData;
+    HANDLE find = FindFirstFileW((path + L"\\*").c_str(), &findData);
+    if (find == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        const std::wstring name = findData.cFileName;
+        if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+            fileNames.push_back(name);
+        } else if (name != L"." && name != L"..") {
+            directoryNames.push_back(name);
+        }
+    } while (FindNextFileW(find, &findData));
+    FindClose(find);
+
+    auto byName = [](const std::wstring& lhs, const std::wstring& rhs) {
+        return StrCmpLogicalW(lhs.c_str(), rhs.c_str()) < 0;
+    };
+    std::sort(fileNames.begin(), fileNames.end(), byName);
+    for (const auto& name : fileNames) {
+        output.push_back(path + L"\\" + name);
+    }
+    if (!isRecursive) {
+        return;
+    }
+    std::sort(directoryNames.begin(), directoryNames.end(), byName);
+    for (const auto& name : directoryNames) {
+        ListDirectory(path + L"\\" + name, isRecursive, output);
+    }
+}
+
+CDocumentsLoader::CDocumentsLoader(CBasicDocumentModel* _model, CDocumentFactory _factory) :
+    model{_model},
+    factory{std::move(_factory)}
+{
+    TRACE()
+
+    NOTNULL(model);
+    if (!factory) {
+        factory = [](const std::wstring& path) -> IDocument* {
+            return new CDocumentFromDisk{path.c_str()};
+        };
+    }
+}
+
+CDocumentsLoader::~CDocumentsLoader()
+{
+    TRACE()
+
+    Cancel();
+}
+
+void CDocumentsLoader::AddFiles(const std::vector<std::wstring>& paths)
+{
+    TRACE()
+
+    if (paths.empty()) {
+        return;
+    }
+    if (files.empty()) {
+        start = std::chrono::steady_clock::now();
+        progress = CDocumentsLoadProgress{};
+    }
+    for (const auto& path : paths) {
+        files.push_back(CFile{path, nullptr, false});
+    }
+    progress.totalCount += paths.size();
+    submitOpens();
+}
+
+void CDocumentsLoader::AddDirectory(const std::wstring& path, bool isRecursive)
+{
+    TRACE()
+
+    std::vector<std::wstring> paths;
+    ListDirectory(path, isRecursive, paths);
+    AddFiles(paths);
+}
+
+void CDocumentsLoader::Cancel()
+{
+    TRACE()
+
+    // Completions of the cancelled jobs are dropped, so none of them refers to the files anymore
+    for (size_t i = firstPending; i < firstUnsubmitted; ++i) {
+        CDecodeWorkerPool::Instance().Cancel(&files[i]);
+    }
+    files.clear();
+    firstPending = 0;
+    firstUnsubmitted = 0;
+    openingCount = 0;
+}
+
+void CDocumentsLoader::submitOpens()
+{
+    for (; openingCount < MaxOpensInFlight && firstUnsubmitted < files.size(); ++firstUnsubmitted, ++openingCount) {
+        auto& file = files[firstUnsubmitted];
+        CDecodeWorkerPool::Instance().Submit(&file, [this, &file] {
+            // Documents read the frame headers of all their pages when they are created,
+            // it is done here rather than on the UI thread
+            file.document.reset(factory(file.path));
+            return [this, &file] {
+                this->onOpened(file);
+            };
+        });
+    }
+}
+
+void CDocumentsLoader::onOpened(CFile& file)
+{
+    TRACE()
+
+    file.isOpened = true;
+    --openingCount;
+    ++progress.doneCount;
+    submitOpens();
+    insertOpened();
+}
+
+void CDocumentsLoader::insertOpened()
+{
+    size_t readyEnd = firstPending;
+    while (readyEnd < files.size() && files[readyEnd].isOpened) {
+        ++readyEnd;
+    }
+    const bool isDone = readyEnd == files.size();
+    // The first document is added right away, so something is shown as soon as possible
+    const bool isBatchReady = progress.insertedCount == 0 || readyEnd - firstPending >= BatchSize;
+    if (readyEnd == firstPending || !(isDone || isBatchReady)) {
+        return;
+    }
+
+    {
+        CDocumentsModelUpdateScope update{model};
+        for (; firstPending < readyEnd; ++firstPending) {
+            auto& document = files[firstPending].document;
+            if (document == nullptr || document->GetPagesCount() == 0) {
+                ++progress.failedCount;
+                document.reset();
+                continue;
+            }
+            model->AddDocument(document.release());
+            ++progress.insertedCount;
+        }
+    }
+    if (progress.insertedCount != 0 && progress.timeToFirstPage == std::chrono::steady_clock::duration::zero()) {
+        progress.timeToFirstPage = std::chrono::steady_clock::now() - start;
+    }
+
+    // Callbacks may give the loader new files, which resets the progress
+    const CDocumentsLoadProgress currentProgress = progress;
+    if (!isDone) {
+        Notify<&IDocumentsLoaderCallback::OnLoadingProgress>(currentProgress);
+        return;
+    }
+    files.clear();
+    firstPending = 0;
+    firstUnsubmitted = 0;
+    Notify<&IDocumentsLoaderCallback::OnLoadingProgress>(currentProgress);
+    Notify<&IDocumentsLoaderCallback::OnLoadingFinished>(currentProgress);
+}
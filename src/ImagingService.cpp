@@ -0,0 +1,62 @@
+#include <ImagingService.h>
+
+#include <Defines.h>
+
+#include <dwrite.h>
+#include <wincodec.h>
+
+CImagingService& CImagingService::Instance()
+{
+    static CImagingService service;
+    return service;
+}
+
+IWICImagingFactory* CImagingService::GetWICFactory()
+{
+    // Documents are opened on the UI thread and decoded on workers, so the factory may be asked for from any of them
+    std::call_once(wicFactoryCreated, [this] {
+        OK(CoCreateInstance(
+                CLSID_WICImagingFactory,
+                NULL,
+                CLSCTX_INPROC_SERVER,
+                IID_PPV_ARGS(&wicFactory)
+            )
+        );
+    });
+    return wicFactory;
+}
+
+IDWriteFactory* CImagingService::GetDirectWriteFactory()
+{
+    // Headers are measured on the layout thread and drawn on the UI one
+    std::call_once(directWriteFactoryCreated, [this] {
+        OK(DWriteCreateFactory(
+                DWRITE_FACTORY_TYPE_ISOLATED, __uuidof(IDWriteFactory),
+                reinterpret_cast<IUnknown**>(&directWriteFactory.ptr)
+            )
+        );
+    });
+    return directWriteFactory.ptr;
+}
+
+void CImagingService::RecordOpen(std::chrono::steady_clock::duration elapsed)
+{
+    opens.fetch_add(1, std::memory_order_relaxed);
+    openNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+}
+
+void CImagingService::RecordDecode(std::chrono::steady_clock::duration elapsed)
+{
+    decodes.fetch_add(1, std::memory_order_relaxed);
+    decodeNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+}
+
+CImagingTimings CImagingService::GetTimings() const
+{
+    CImagingTimings timings;
+    timings.opens = opens.load(std::memory_order_relaxed);
+    timings.openMs = openNs.load(std::memory_order_relaxed) / 1e6;
+    timings.decodes = decodes.load(std::memory_order_relaxed);
+    timings.decodeMs = decodeNs.load(std::memory_order_relaxed) / 1e6;
+    return timings;
+}
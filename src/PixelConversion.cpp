@@ -0,0 +1,221 @@
+#include "PixelConversion.h"
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define D2DILV_SSE2
+#include <emmintrin.h>
+#endif
+
+// SSSE3 and AVX2 are not enabled by the build flags, so their kernels are compiled for these instruction sets
+// one by one and chosen when the CPU has them
+#if defined(D2DILV_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define D2DILV_RUNTIME_DISPATCH
+#define D2DILV_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(D2DILV_SSE2) && defined(_MSC_VER)
+#define D2DILV_RUNTIME_DISPATCH
+#define D2DILV_TARGET(isa)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+namespace {
+
+/// @brief c * a / 255 rounded to the nearest, the same as dividing in floating point
+inline uint8_t MultiplyByAlpha(uint8_t color, uint8_t alpha)
+{
+    const unsigned product = unsigned(color) * alpha + 128;
+    return uint8_t((product + (product >> 8)) >> 8);
+}
+
+inline void PremultiplyPixel(uint8_t* pixel)
+{
+    const uint8_t alpha = pixel[3];
+    pixel[0] = MultiplyByAlpha(pixel[0], alpha);
+    pixel[1] = MultiplyByAlpha(pixel[1], alpha);
+    pixel[2] = MultiplyByAlpha(pixel[2], alpha);
+}
+
+#ifdef D2DILV_RUNTIME_DISPATCH
+struct CCpuFeatures {
+    bool hasSsse3 = false;
+    bool hasAvx2 = false;
+};
+
+const CCpuFeatures& CpuFeatures()
+{
+    static const CCpuFeatures features = [] {
+        CCpuFeatures detected;
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_cpu_init();
+        detected.hasSsse3 = __builtin_cpu_supports("ssse3");
+        detected.hasAvx2 = __builtin_cpu_supports("avx2");
+#else
+        int info[4] = {};
+        __cpuid(info, 0);
+        const int maxLeaf = info[0];
+        __cpuid(info, 1);
+        detected.hasSsse3 = (info[2] & (1 << 9)) != 0;
+        // AVX registers are usable only if the OS saves them
+        const bool hasOsAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+        if (hasOsAvx && maxLeaf >= 7) {
+            __cpuidex(info, 7, 0);
+            detected.hasAvx2 = (info[1] & (1 << 5)) != 0;
+        }
+#endif
+        return detected;
+    }();
+    return features;
+}
+
+/// @brief Premultiply two pixels unpacked to 16 bit channels
+inline __m128i PremultiplyUnpacked(__m128i pixels)
+{
+    const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    const __m128i product = _mm_add_epi16(_mm_mullo_epi16(pixels, alpha), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+}
+
+D2DILV_TARGET("avx2") inline __m256i PremultiplyUnpacked(__m256i pixels)
+{
+    const __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    const __m256i product = _mm256_add_epi16(_mm256_mullo_epi16(pixels, alpha), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(product, _mm256_srli_epi16(product, 8)), 8);
+}
+
+// The kernels below return how many pixels they converted, the rest is left to the scalar loops
+
+D2DILV_TARGET("avx2") size_t ConvertBgrToPbgraAvx2(const uint8_t* source, uint8_t* destination, size_t pixelsCount)
+{
+    // 4 pixels of each 128 bit lane are taken from 12 bytes, the loads read 4 bytes more, so the tail is left to the scalar loop
+    const __m256i spread = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i opaque = _mm256_set1_epi32(int(0xFF000000));
+    size_t i = 0;
+    for (; i + 10 <= pixelsCount; i += 8) {
+        const __m256i bgr = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 3))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 3 + 12)), 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(bgr, spread), opaque));
+    }
+    return i;
+}
+
+D2DILV_TARGET("ssse3") size_t ConvertBgrToPbgraSsse3(const uint8_t* source, uint8_t* destination, size_t pixelsCount)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i opaque = _mm_set1_epi32(int(0xFF000000));
+    size_t i = 0;
+    for (; i + 6 <= pixelsCount; i += 4) {
+        const __m128i bgr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 4), _mm_or_si128(_mm_shuffle_epi8(bgr, spread), opaque));
+    }
+    return i;
+}
+
+D2DILV_TARGET("avx2") size_t PremultiplyBgraAvx2(uint8_t* pixels, size_t pixelsCount)
+{
+    const __m256i alphaMask = _mm256_set1_epi32(int(0xFF000000));
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= pixelsCount; i += 8) {
+        auto address = reinterpret_cast<__m256i*>(pixels + i * 4);
+        const __m256i bgra = _mm256_loadu_si256(address);
+        // Opaque pixels are common in photos with an alpha channel, they stay as they are
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(bgra, alphaMask), alphaMask)) == -1) {
+            continue;
+        }
+        // Unpacking and packing work inside 128 bit lanes, so pixels keep their order
+        const __m256i premultiplied = _mm256_packus_epi16(
+            PremultiplyUnpacked(_mm256_unpacklo_epi8(bgra, zero)),
+            PremultiplyUnpacked(_mm256_unpackhi_epi8(bgra, zero)));
+        _mm256_storeu_si256(address, _mm256_or_si256(_mm256_andnot_si256(alphaMask, premultiplied), _mm256_and_si256(bgra, alphaMask)));
+    }
+    return i;
+}
+
+size_t PremultiplyBgraSse2(uint8_t* pixels, size_t pixelsCount)
+{
+    const __m128i alphaMask = _mm_set1_epi32(int(0xFF000000));
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= pixelsCount; i += 4) {
+        auto address = reinterpret_cast<__m128i*>(pixels + i * 4);
+        const __m128i bgra = _mm_loadu_si128(address);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(bgra, alphaMask), alphaMask)) == 0xFFFF) {
+            continue;
+        }
+        const __m128i premultiplied = _mm_packus_epi16(
+            PremultiplyUnpacked(_mm_unpacklo_epi8(bgra, zero)),
+            PremultiplyUnpacked(_mm_unpackhi_epi8(bgra, zero)));
+        _mm_storeu_si128(address, _mm_or_si128(_mm_andnot_si128(alphaMask, premultiplied), _mm_and_si128(bgra, alphaMask)));
+    }
+    return i;
+}
+
+D2DILV_TARGET("avx2") size_t FillOpaqueAlphaAvx2(uint8_t* pixels, size_t pixelsCount)
+{
+    const __m256i opaque = _mm256_set1_epi32(int(0xFF000000));
+    size_t i = 0;
+    for (; i + 8 <= pixelsCount; i += 8) {
+        auto address = reinterpret_cast<__m256i*>(pixels + i * 4);
+        _mm256_storeu_si256(address, _mm256_or_si256(_mm256_loadu_si256(address), opaque));
+    }
+    return i;
+}
+
+size_t FillOpaqueAlphaSse2(uint8_t* pixels, size_t pixelsCount)
+{
+    const __m128i opaque = _mm_set1_epi32(int(0xFF000000));
+    size_t i = 0;
+    for (; i + 4 <= pixelsCount; i += 4) {
+        auto address = reinterpret_cast<__m128i*>(pixels + i * 4);
+        _mm_storeu_si128(address, _mm_or_si128(_mm_loadu_si128(address), opaque));
+    }
+    return i;
+}
+#endif
+
+}
+
+void ConvertBgrToPbgra(const uint8_t* source, uint8_t* destination, size_t pixelsCount)
+{
+    size_t i = 0;
+#ifdef D2DILV_RUNTIME_DISPATCH
+    if (CpuFeatures().hasAvx2) {
+        i = ConvertBgrToPbgraAvx2(source, destination, pixelsCount);
+    } else if (CpuFeatures().hasSsse3) {
+        i = ConvertBgrToPbgraSsse3(source, destination, pixelsCount);
+    }
+#endif
+    for (; i < pixelsCount; ++i) {
+        destination[i * 4] = source[i * 3];
+        destination[i * 4 + 1] = source[i * 3 + 1];
+        destination[i * 4 + 2] = source[i * 3 + 2];
+        destination[i * 4 + 3] = 0xFF;
+    }
+}
+
+void PremultiplyBgra(uint8_t* pixels, size_t pixelsCount)
+{
+    size_t i = 0;
+#ifdef D2DILV_RUNTIME_DISPATCH
+    i = CpuFeatures().hasAvx2 ? PremultiplyBgraAvx2(pixels, pixelsCount) : PremultiplyBgraSse2(pixels, pixelsCount);
+#endif
+    for (; i < pixelsCount; ++i) {
+        PremultiplyPixel(pixels + i * 4);
+    }
+}
+
+void FillOpaqueAlpha(uint8_t* pixels, size_t pixelsCount)
+{
+    size_t i = 0;
+#ifdef D2DILV_RUNTIME_DISPATCH
+    i = CpuFeatures().hasAvx2 ? FillOpaqueAlphaAvx2(pixels, pixelsCount) : FillOpaqueAlphaSse2(pixels, pixelsCount);
+#endif
+    for (; i < pixelsCount; ++i) {
+        pixels[i * 4 + 3] = 0xFF;
+    }
+}
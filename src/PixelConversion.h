@@ -0,0 +1,26 @@
+#ifndef D2DILV_PIXEL_CONVERSION_H
+#define D2DILV_PIXEL_CONVERSION_H
+
+#include <cstddef>
+#include <cstdint>
+
+/// Conversions of decoded rows to the 32bpp premultiplied BGRA that bitmaps are created from.
+/// They replace IWICFormatConverter for the most common formats of photos and scans.
+
+/// @brief Expand 24bpp BGR pixels to opaque 32bpp PBGRA
+/// @param source Pixels to convert
+/// @param destination Output, 4 bytes per pixel, must not overlap the source
+/// @param pixelsCount Number of pixels
+void ConvertBgrToPbgra(const uint8_t* source, uint8_t* destination, size_t pixelsCount);
+
+/// @brief Multiply colors of 32bpp BGRA pixels by their alpha in place, turning them into PBGRA
+/// @param pixels Pixels to convert
+/// @param pixelsCount Number of pixels
+void PremultiplyBgra(uint8_t* pixels, size_t pixelsCount);
+
+/// @brief Make 32bpp BGR pixels, whose fourth byte is undefined, opaque PBGRA in place
+/// @param pixels Pixels to convert
+/// @param pixelsCount Number of pixels
+void FillOpaqueAlpha(uint8_t* pixels, size_t pixelsCount);
+
+#endif
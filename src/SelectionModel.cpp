@@ -2,6 +2,8 @@
 
 #include <Defines.h>
 
+#include <vector>
+
 CSelectionModel::CSelectionModel(IDocumentsModel* _model) : model{_model}
 {
     if (model != nullptr) {
@@ -68,8 +70,10 @@ void CSelectionModel::Select(int index, TSelectionMode mode)
         }
         auto [begin, end] = std::minmax({index, activeIndex});
         ++end;
+        std::vector<CPageInfo> pageInfos(end - begin);
+        model->GetPages(begin, end - begin, pageInfos.data());
         for (int i = begin; i < end; ++i) {
-            this->indexToPage[i] = model->GetData(index, TDocumentModelRoles::PageRole);
+            this->indexToPage[i] = const_cast<IPage*>(pageInfos[i - begin].page);
         }
         break;
     }
@@ -80,7 +84,9 @@ void CSelectionModel::Select(int index, TSelectionMode mode)
             this->selectOneActive(index);
             break;
         }
-        this->indexToPage[index] = model->GetData(index, TDocumentModelRoles::PageRole);
+        CPageInfo pageInfo;
+        model->GetPages(index, 1, &pageInfo);
+        this->indexToPage[index] = const_cast<IPage*>(pageInfo.page);
     }
     default:
         break;
@@ -148,19 +154,21 @@ void CSelectionModel::OnDocumentDeleted(IDocument* doc)
         return;
     }
 
-    for (auto it = indexToPage.begin(); it != indexToPage.end();)
-    {
-        if (doc->GetIndexOf(reinterpret_cast<const IPage*>(it->second)) != -1) {
-            it = indexToPage.erase(it);
-        } else {
-            ++it;
-        }
-    }
+    this->deselectPagesOf(doc);
+    Notify<&ISelectionModelCallback::OnSelectionChanged>(GetSelectedPages());
+}
 
-    if (indexToPage.empty()) {
-        this->activeIndex = -1;
+void CSelectionModel::OnModelUpdated(const CDocumentsModelChanges& changes)
+{
+    TRACE()
+
+    if (indexToPage.empty() || changes.deletedDocuments.empty()) {
+        return;
     }
 
+    for (auto doc : changes.deletedDocuments) {
+        this->deselectPagesOf(doc);
+    }
     Notify<&ISelectionModelCallback::OnSelectionChanged>(GetSelectedPages());
 }
 
@@ -169,6 +177,26 @@ void CSelectionModel::selectOneActive(int index)
     TRACE()
 
     this->indexToPage.clear();
-    this->indexToPage[index] = model->GetData(index, TDocumentModelRoles::PageRole);
+    CPageInfo pageInfo;
+    model->GetPages(index, 1, &pageInfo);
+    this->indexToPage[index] = const_cast<IPage*>(pageInfo.page);
     this->activeIndex = index;
 }
+
+void CSelectionModel::deselectPagesOf(const IDocument* doc)
+{
+    TRACE()
+
+    for (auto it = indexToPage.begin(); it != indexToPage.end();)
+    {
+        if (doc->GetIndexOf(reinterpret_cast<const IPage*>(it->second)) != -1) {
+            it = indexToPage.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (indexToPage.empty()) {
+        this->activeIndex = -1;
+    }
+}